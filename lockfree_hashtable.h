@@ -1,61 +1,1640 @@
 #ifndef LOCKFREE_HASHTABLE_H
 #define LOCKFREE_HASHTABLE_H
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
-#include <cmath>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <optional>
+#include <ratio>
+#include <span>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Allocation policy that forwards to the global heap.
+struct DefaultAllocator {
+  static void* Allocate(size_t size) { return ::operator new(size); }
+  static void Deallocate(void* ptr, size_t size) {
+    ::operator delete(ptr, size);
+  }
+};
+
+// Allocation policy that serves blocks from per-thread free lists carved out
+// of slabs, so allocating and freeing nodes takes no lock and normally touches
+// no shared memory. A freed block goes to the cache of the freeing thread. When
+// that cache grows too large, or its thread exits, blocks are handed over to a
+// lock-free global list from which other threads refill. Slabs are kept for
+// the lifetime of the process.
+class SlabAllocator {
+ public:
+  static void* Allocate(size_t size) {
+    if (size > kMaxBlockSize) return ::operator new(size);
+
+    int size_class = SizeClass(size);
+    ThreadCache& cache = GetThreadCache();
+    if (nullptr == cache.free_list[size_class]) cache.Refill(size_class);
+
+    FreeBlock* block = cache.free_list[size_class];
+    cache.free_list[size_class] = block->next;
+    --cache.free_count[size_class];
+    return block;
+  }
+
+  static void Deallocate(void* ptr, size_t size) {
+    if (size > kMaxBlockSize) {
+      ::operator delete(ptr);
+      return;
+    }
+
+    int size_class = SizeClass(size);
+    ThreadCache& cache = GetThreadCache();
+    FreeBlock* block = static_cast<FreeBlock*>(ptr);
+    if (cache.released) {
+      block->next = nullptr;
+      PushOrphanList(size_class, block);
+      return;
+    }
+
+    block->next = cache.free_list[size_class];
+    cache.free_list[size_class] = block;
+    if (++cache.free_count[size_class] > 2 * kFlushCount) {
+      cache.Flush(size_class);
+    }
+  }
+
+ private:
+  static const size_t kSlabSize = 64 * 1024;
+  static const size_t kMaxBlockSize = 16 * 1024;
+  // 16 classes in 16 bytes steps up to 256 bytes, then powers of 2.
+  static const int kNumSizeClasses = 22;
+  // Number of blocks handed over to other threads at once.
+  static const size_t kFlushCount = 256;
+
+  struct FreeBlock {
+    FreeBlock* next;       // Next block of the same list.
+    FreeBlock* next_list;  // Next list in orphan_lists_.
+  };
+
+  // The cache is trivially destructible, so that it stays usable from
+  // thread_local destructors that run after its owner, e.g. a reclaimer which
+  // frees nodes when its thread exits.
+  struct ThreadCache {
+    // Hand all blocks over to other threads.
+    void Release() {
+      for (int i = 0; i < kNumSizeClasses; ++i) {
+        if (free_list[i] != nullptr) PushOrphanList(i, free_list[i]);
+        free_list[i] = nullptr;
+        free_count[i] = 0;
+      }
+      released = true;
+    }
+
+    // Adopt blocks given up by other threads, or carve a new slab.
+    void Refill(int size_class) {
+      FreeBlock* lists = orphan_lists_[size_class].exchange(
+          nullptr, std::memory_order_acquire);
+      while (lists != nullptr) {
+        FreeBlock* list = lists;
+        lists = lists->next_list;
+        FreeBlock* tail = list;
+        ++free_count[size_class];
+        while (tail->next != nullptr) {
+          tail = tail->next;
+          ++free_count[size_class];
+        }
+        tail->next = free_list[size_class];
+        free_list[size_class] = list;
+      }
+      if (free_list[size_class] != nullptr) return;
+
+      size_t block_size = BlockSize(size_class);
+      char* slab = static_cast<char*>(::operator new(kSlabSize));
+      for (size_t offset = 0; offset + block_size <= kSlabSize;
+           offset += block_size) {
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(slab + offset);
+        block->next = free_list[size_class];
+        free_list[size_class] = block;
+        ++free_count[size_class];
+      }
+    }
+
+    // Hand kFlushCount blocks over to other threads.
+    void Flush(int size_class) {
+      FreeBlock* list = free_list[size_class];
+      FreeBlock* tail = list;
+      for (size_t i = 1; i < kFlushCount; ++i) tail = tail->next;
+      free_list[size_class] = tail->next;
+      free_count[size_class] -= kFlushCount;
+      tail->next = nullptr;
+      PushOrphanList(size_class, list);
+    }
+
+    FreeBlock* free_list[kNumSizeClasses];
+    size_t free_count[kNumSizeClasses];
+    bool released;  // Whether the owner thread is exiting.
+  };
+
+  struct ThreadCacheOwner {
+    ~ThreadCacheOwner() { GetThreadCache().Release(); }
+  };
 
-#include "HazardPointer/reclaimer.h"
+  static ThreadCache& GetThreadCache() {
+    thread_local static ThreadCache cache;
+    thread_local static ThreadCacheOwner owner;
+    return cache;
+  }
+
+  static void PushOrphanList(int size_class, FreeBlock* list) {
+    FreeBlock* head = orphan_lists_[size_class].load(std::memory_order_relaxed);
+    do {
+      list->next_list = head;
+    } while (!orphan_lists_[size_class].compare_exchange_weak(
+        head, list, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  static int SizeClass(size_t size) {
+    if (size <= 256) return (size + 15) / 16 - 1;
+    // Ceil of log2(size), 512 bytes maps to class 16.
+    return 64 - __builtin_clzl(size - 1) + 7;
+  }
+
+  static size_t BlockSize(int size_class) {
+    if (size_class < 16) return (size_class + 1) * 16;
+    return static_cast<size_t>(1) << (size_class - 7);
+  }
+
+  // Lists of blocks given up by threads, linked by FreeBlock::next_list.
+  // Lists are only ever taken all at once, so pushing is ABA safe.
+  static inline std::atomic<FreeBlock*> orphan_lists_[kNumSizeClasses];
+};
+
+// Item counter for tables updated by many threads. Each thread adds to its own
+// stripe on a separate cache line, and a stripe moves its count into the
+// shared total once it reaches a batch, so counting seldom writes memory that
+// other threads read. The batch is 1/512 of the total, up to kMaxBatch, so the
+// stripes hold at most 1/8 of a growing total and small totals move at every
+// Add. A stripe left over from a larger batch waits for its thread's next Add.
+class StripedCounter {
+ public:
+  StripedCounter() : total_(0) {
+    for (Stripe& stripe : stripes_) {
+      stripe.count.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  StripedCounter(const StripedCounter&) = delete;
+  StripedCounter& operator=(const StripedCounter&) = delete;
+
+  // Add delta to the stripe of the calling thread, return whether it moved
+  // its count into the total.
+  bool Add(int64_t delta) {
+    std::atomic<int64_t>& count = stripes_[GetStripeIndex()].count;
+    int64_t value = count.fetch_add(delta, std::memory_order_relaxed) + delta;
+    int64_t batch = std::clamp(
+        total_.load(std::memory_order_relaxed) / kBatchDivisor, int64_t(1),
+        kMaxBatch);
+    if (value < batch && value > -batch) return false;
+    // Several threads may share the stripe, the one which empties it moves
+    // its count.
+    if (!count.compare_exchange_strong(value, 0, std::memory_order_relaxed)) {
+      return false;
+    }
+    total_.fetch_add(value, std::memory_order_relaxed);
+    return true;
+  }
+
+  // The total, a single load.
+  size_t Load() const {
+    return std::max(total_.load(std::memory_order_relaxed), int64_t(0));
+  }
 
-// The maximum bucket size equals to kSegmentSize^kMaxLevel, in this case the
-// maximum bucket size is 64^4. If the load factor is 0.5, the maximum number of
-// items that Hash Table contains is 64^4 * 0.5 = 2^23. You can adjust the
-// following two values according to your memory size.
-const int kMaxLevel = 4;
-const int kSegmentSize = 64;
-const size_t kMaxBucketSize = pow(kSegmentSize, kMaxLevel);
+  // The total plus what the stripes hold, exact unless the count changes
+  // meanwhile.
+  size_t LoadExact() const {
+    int64_t sum = total_.load(std::memory_order_relaxed);
+    for (const Stripe& stripe : stripes_) {
+      sum += stripe.count.load(std::memory_order_relaxed);
+    }
+    return std::max(sum, int64_t(0));
+  }
 
-// Hash Table can be stored 2^power_of_2_ * kLoadFactor items.
-const float kLoadFactor = 0.5;
+ private:
+  static constexpr int kStripes = 64;
+  static constexpr int64_t kMaxBatch = 64;
+  static constexpr int64_t kBatchDivisor = 8 * kStripes;
+
+  struct alignas(64) Stripe {
+    std::atomic<int64_t> count;
+  };
+
+  // Threads take stripes in turn.
+  static size_t GetStripeIndex() {
+    thread_local static const size_t index =
+        next_stripe_index_.fetch_add(1, std::memory_order_relaxed) % kStripes;
+    return index;
+  }
+
+  static inline std::atomic<size_t> next_stripe_index_{0};
+
+  alignas(64) std::atomic<int64_t> total_;
+  Stripe stripes_[kStripes];
+};
+
+// Resize rule shared by the geometry policies of the bucket directory. The
+// table never holds more than LoadFactor items per bucket, as it grows its
+// buckets go straight to the least power of 2 that keeps to it, and once it
+// has 2^MaxPowerOf2 buckets the lists just get longer. It
+// halves them again when it holds less than LowWater items per bucket. By
+// default LowWater is zero and the table never shrinks, which spares lookups
+// the hazard pointers that guard bucket heads and arrays against Shrink.
+template <size_t MaxPowerOf2, typename LoadFactor, typename LowWater>
+struct GeometryBase {
+  static_assert(MaxPowerOf2 >= 1 && MaxPowerOf2 < 64,
+                "Bucket size must be between 2 and 2^63");
+  static_assert(LoadFactor::num > 0, "LoadFactor must be positive");
+  static_assert(LowWater::num >= 0, "LowWater must not be negative");
+  // Otherwise the table could grow right after it shrinks.
+  static_assert(std::ratio_less_equal_v<
+                    std::ratio_multiply<LowWater, std::ratio<2>>, LoadFactor>,
+                "LowWater must be at most half of LoadFactor");
+
+  static constexpr size_t kMaxPowerOf2 = MaxPowerOf2;
+  static constexpr size_t kMaxBucketSize = size_t(1) << MaxPowerOf2;
+  static constexpr bool kShrinkable = LowWater::num > 0;
+
+  // The least power_of_2, up to kMaxPowerOf2, at which 2^power_of_2 buckets
+  // hold size items.
+  static constexpr size_t TargetPowerOf2(size_t size) {
+    size_t buckets = (size * LoadFactor::den + LoadFactor::num - 1) /
+                     LoadFactor::num;
+    if (buckets <= 2) return 1;
+    return std::min<size_t>(64 - __builtin_clzl(buckets - 1), kMaxPowerOf2);
+  }
+
+  // Whether a table of 2^power_of_2 buckets which holds size items should
+  // halve its buckets.
+  static constexpr bool ShouldShrink(size_t power_of_2, size_t size) {
+    return kShrinkable && power_of_2 > 1 && power_of_2 <= kMaxPowerOf2 &&
+           size * LowWater::den < (size_t(1) << power_of_2) * LowWater::num;
+  }
+
+  // The first block of span buckets, aligned to span, which lies at or above
+  // first and whose last bucket is at or above begin. Shrink empties the
+  // buckets from first on in runs of [begin, end), a directory releases the
+  // blocks which end in a run.
+  static constexpr size_t FirstShrinkBlock(size_t first, size_t begin,
+                                           size_t span) {
+    size_t block = std::max(first, begin + 1 > span ? begin + 1 - span : 0);
+    return (block + span - 1) / span * span;
+  }
+};
+
+// Geometry policy of the bucket directory. The directory is a tree of Levels
+// levels of segments with FanOut entries each, the top segment lives inside
+// the table and the segments of the last level hold the buckets, so there are
+// at most FanOut^Levels buckets. A 1-level directory is a plain array of
+// buckets with no pointer to chase.
+template <int Levels, int FanOut, typename LoadFactor = std::ratio<1, 2>,
+          typename LowWater = std::ratio<0>>
+struct SegmentGeometry
+    : GeometryBase<__builtin_ctz(FanOut) * Levels, LoadFactor, LowWater> {
+  static_assert(Levels >= 1, "At least one level is required");
+  static_assert(FanOut > 1 && (FanOut & (FanOut - 1)) == 0,
+                "FanOut must be a power of 2");
+
+  static constexpr int kMaxLevel = Levels;
+  static constexpr int kSegmentSize = FanOut;
+  static constexpr int kSegmentShift = __builtin_ctz(FanOut);
+  static constexpr size_t kSegmentMask = FanOut - 1;
+
+  // Maps a bucket index to its bucket, each level consumes kSegmentShift bits
+  // of the index, the most significant ones at level 1. Shrink retires the
+  // bucket arrays of the last level and the segments above it, so the bucket
+  // returned by Get and GetOrCreate stays valid only as long as hp protects
+  // its array, and the segments on its path are protected while they are
+  // walked. Tables which never shrink pass no reclaimer and get no
+  // protection.
+  template <typename Bucket, typename Allocator>
+  class Directory {
+    // Entry of a segment above the last level, points to the FanOut entries
+    // of the next level, either segments or buckets.
+    typedef std::atomic<void*> Segment;
+    typedef std::conditional_t<Levels == 1, Bucket, Segment> TopEntry;
+
+    static constexpr bool kRetireBuckets = LowWater::num > 0;
+    // Only segments between the top and the last level are retired.
+    static constexpr bool kRetireSegments = kRetireBuckets && Levels > 2;
+
+   public:
+    Directory() {
+      for (int i = 0; i < FanOut; ++i) {
+        top_[i].store(nullptr, std::memory_order_relaxed);
+      }
+    }
+
+    ~Directory() {
+      if constexpr (Levels > 1) DeleteSegments(top_, 1);
+    }
+
+    Directory(const Directory&) = delete;
+    Directory& operator=(const Directory&) = delete;
+
+    // Get the bucket, if the segments on its path not exist then return
+    // nullptr.
+    template <typename Reclaimer, typename HazardPointer>
+    Bucket* Get(size_t bucket_index, Reclaimer* reclaimer, HazardPointer& hp) {
+      if constexpr (Levels == 1) {
+        return &top_[GetIndex(bucket_index, 1)];
+      } else {
+        HazardPointer segment_hps[2];
+        Segment* segments = top_;
+        for (int level = 1; level < Levels - 1; ++level) {
+          void* next = Protect<kRetireSegments>(
+              segments[GetIndex(bucket_index, level)], reclaimer,
+              segment_hps[level & 1]);
+          if (nullptr == next || Sealed() == next) return nullptr;
+          segments = static_cast<Segment*>(next);
+        }
+        void* buckets = Protect<kRetireBuckets>(
+            segments[GetIndex(bucket_index, Levels - 1)], reclaimer, hp);
+        if (nullptr == buckets || Sealed() == buckets) return nullptr;
+        return static_cast<Bucket*>(buckets) + GetIndex(bucket_index, Levels);
+      }
+    }
+
+    // A lookup which goes down one level per call of Prefetch, so that a
+    // batch of them can prefetch a level for all before any reads it. array
+    // is the segment of the level reached, or the bucket array after the
+    // last, nullptr when the path ends. The arrays are protected hand over
+    // hand as in Get, array by hps[level & 1].
+    template <typename HazardPointer>
+    struct Cursor {
+      void* array = nullptr;
+      HazardPointer hps[2];
+    };
+
+    static constexpr int kLevels = Levels;
+
+    // Move cursor to level, from 1 to kLevels in turn, on the path to
+    // bucket_index and prefetch the entry it reads there.
+    template <typename Reclaimer, typename HazardPointer>
+    void Prefetch(size_t bucket_index, int level,
+                  Cursor<HazardPointer>& cursor, Reclaimer* reclaimer) {
+      if (1 == level) {
+        cursor.array = top_;
+      } else if (nullptr != cursor.array) {
+        Segment& entry = static_cast<Segment*>(
+            cursor.array)[GetIndex(bucket_index, level - 1)];
+        HazardPointer& hp = cursor.hps[level & 1];
+        void* next = level < Levels
+                         ? Protect<kRetireSegments>(entry, reclaimer, hp)
+                         : Protect<kRetireBuckets>(entry, reclaimer, hp);
+        cursor.array = Sealed() == next ? nullptr : next;
+      }
+      if (nullptr == cursor.array) return;
+      if (level < Levels) {
+        __builtin_prefetch(static_cast<Segment*>(cursor.array) +
+                           GetIndex(bucket_index, level));
+      } else {
+        __builtin_prefetch(static_cast<Bucket*>(cursor.array) +
+                           GetIndex(bucket_index, Levels));
+      }
+    }
+
+    // The bucket a cursor moved to kLevels reached, see Get.
+    template <typename HazardPointer>
+    Bucket* Get(size_t bucket_index, Cursor<HazardPointer>& cursor) {
+      if (nullptr == cursor.array) return nullptr;
+      return static_cast<Bucket*>(cursor.array) +
+             GetIndex(bucket_index, Levels);
+    }
+
+    // Get the bucket, allocate the segments on its path if they not exist.
+    template <typename Reclaimer, typename HazardPointer>
+    Bucket& GetOrCreate(size_t bucket_index, Reclaimer* reclaimer,
+                        HazardPointer& hp) {
+      if constexpr (Levels == 1) {
+        return top_[GetIndex(bucket_index, 1)];
+      } else {
+        HazardPointer segment_hps[2];
+        while (true) {
+          Segment* segments = top_;
+          for (int level = 1; level < Levels - 1 && nullptr != segments;
+               ++level) {
+            Segment& entry = segments[GetIndex(bucket_index, level)];
+            void* next = Protect<kRetireSegments>(entry, reclaimer,
+                                                  segment_hps[level & 1]);
+            while (nullptr == next) {
+              LoadOrCreate<Segment>(entry);
+              next = Protect<kRetireSegments>(entry, reclaimer,
+                                              segment_hps[level & 1]);
+            }
+            segments = Sealed() == next ? nullptr : static_cast<Segment*>(next);
+          }
+          // A Shrink retired a segment on the path, which is unlinked by
+          // now.
+          if (nullptr == segments) continue;
+
+          Segment& segment = segments[GetIndex(bucket_index, Levels - 1)];
+          void* buckets = Protect<kRetireBuckets>(segment, reclaimer, hp);
+          while (nullptr == buckets) {
+            LoadOrCreate<Bucket>(segment);
+            buckets = Protect<kRetireBuckets>(segment, reclaimer, hp);
+          }
+          if (Sealed() == buckets) continue;
+          return static_cast<Bucket*>(buckets)[GetIndex(bucket_index, Levels)];
+        }
+      }
+    }
+
+    // Get bucket 0, allocate the segments on its path if they not exist. Its
+    // bucket array is never retired, so it needs no protection.
+    Bucket& GetFirst() {
+      if constexpr (Levels == 1) {
+        return top_[0];
+      } else {
+        Segment* segments = top_;
+        for (int level = 1; level < Levels - 1; ++level) {
+          segments = LoadOrCreate<Segment>(segments[0]);
+        }
+        return LoadOrCreate<Bucket>(segments[0])[0];
+      }
+    }
+
+    // Retire the arrays which only hold buckets from first on and whose last
+    // bucket is in [begin, end), bucket arrays before the segments above
+    // them. Shrink calls it for every run of buckets it has emptied, in
+    // order from first, so all buckets below such an array are empty.
+    template <typename Reclaimer>
+    void Shrink(size_t first, size_t begin, size_t end, Reclaimer& reclaimer) {
+      if constexpr (Levels > 1) {
+        size_t span = FanOut;
+        for (int level = Levels - 1; level >= 1; --level, span *= FanOut) {
+          for (size_t block = SegmentGeometry::FirstShrinkBlock(first, begin,
+                                                                span);
+               block + span <= end; block += span) {
+            Segment* segments = LoadSegments(block, level);
+            if (nullptr == segments) continue;
+            Retire(segments[GetIndex(block, level)], level, nullptr,
+                   reclaimer);
+          }
+        }
+      } else {
+        (void)first;
+        (void)begin;
+        (void)end;
+        (void)reclaimer;
+      }
+    }
+
+   private:
+    static constexpr size_t GetIndex(size_t bucket_index, int level) {
+      return (bucket_index >> (kSegmentShift * (Levels - level))) &
+             kSegmentMask;
+    }
+
+    // Stands in for the arrays of a retired segment, so that a thread which
+    // still walks it starts over from the top and none links an array into
+    // it.
+    static void* Sealed() { return &sealed_; }
+
+    // The segment of the given level on the path to bucket_index, nullptr if
+    // the segments on its path not exist. Unprotected, only for Shrink, which
+    // is the one to retire segments.
+    Segment* LoadSegments(size_t bucket_index, int level) {
+      Segment* segments = top_;
+      for (int i = 1; i < level; ++i) {
+        void* next =
+            segments[GetIndex(bucket_index, i)].load(std::memory_order_acquire);
+        if (nullptr == next) return nullptr;
+        segments = static_cast<Segment*>(next);
+      }
+      return segments;
+    }
+
+    // Load the array which entry points to and, when Retired, protect it by
+    // hp.
+    template <bool Retired, typename Reclaimer, typename HazardPointer>
+    static void* Protect(Segment& entry, Reclaimer* reclaimer,
+                         HazardPointer& hp) {
+      void* data = entry.load(std::memory_order_acquire);
+      if constexpr (!Retired) {
+        (void)reclaimer;
+        (void)hp;
+        return data;
+      }
+      while (nullptr != data && Sealed() != data) {
+        hp = HazardPointer(reclaimer, data);
+        void* again = entry.load(std::memory_order_acquire);
+        if (again == data) break;
+        data = again;
+      }
+      return data;
+    }
+
+    // Unlink the array entry of level points to, replacing it by
+    // replacement, and retire it. The entries of a retired segment are
+    // sealed, arrays which threads of the old bucket size linked into it
+    // meanwhile go with it.
+    template <typename Reclaimer>
+    static void Retire(Segment& entry, int level, void* replacement,
+                       Reclaimer& reclaimer) {
+      void* data = entry.exchange(replacement, std::memory_order_acq_rel);
+      if (nullptr == data || Sealed() == data) return;
+      if (level + 1 < Levels) {
+        Segment* segments = static_cast<Segment*>(data);
+        for (int i = 0; i < FanOut; ++i) {
+          Retire(segments[i], level + 1, Sealed(), reclaimer);
+        }
+        reclaimer.ReclaimLater(data, [](void* ptr) {
+          Allocator::Deallocate(ptr, sizeof(Segment) * FanOut);
+        });
+      } else {
+        reclaimer.ReclaimLater(data, [](void* ptr) {
+          Allocator::Deallocate(ptr, sizeof(Bucket) * FanOut);
+        });
+      }
+    }
+
+    // Load the array which segment points to, or try to allocate it, which
+    // fails on a sealed segment.
+    template <typename T>
+    static T* LoadOrCreate(Segment& segment) {
+      void* data = segment.load(std::memory_order_consume);
+      if (nullptr != data) return static_cast<T*>(data);
+
+      T* array = static_cast<T*>(Allocator::Allocate(sizeof(T) * FanOut));
+      for (int i = 0; i < FanOut; ++i) new (array + i) T(nullptr);
+      if (!segment.compare_exchange_strong(data, array,
+                                           std::memory_order_release,
+                                           std::memory_order_consume)) {
+        Allocator::Deallocate(array, sizeof(T) * FanOut);
+        return static_cast<T*>(data);
+      }
+      return array;
+    }
+
+    static void DeleteSegments(Segment* segments, int level) {
+      for (int i = 0; i < FanOut; ++i) {
+        void* data = segments[i].load(std::memory_order_relaxed);
+        if (nullptr == data) continue;
+        if (level + 1 < Levels) {
+          DeleteSegments(static_cast<Segment*>(data), level + 1);
+          Allocator::Deallocate(data, sizeof(Segment) * FanOut);
+        } else {
+          Allocator::Deallocate(data, sizeof(Bucket) * FanOut);
+        }
+      }
+    }
+
+    static inline char sealed_;
+
+    TopEntry top_[FanOut];
+  };
+};
+
+// Geometry policy of a flat bucket directory, for tables whose maximum size
+// is known. All 2^MaxPowerOf2 buckets are reserved as one array of virtual
+// memory, pages are only committed when a bucket on them is first written,
+// so a bucket lookup is a single indexed load. Shrink gives pages back
+// through the reclaimer, once no thread which writes to them protects them,
+// so the bucket returned by GetOrCreate stays writable as long as hp
+// protects its page.
+template <size_t MaxPowerOf2, typename LoadFactor = std::ratio<1, 2>,
+          typename LowWater = std::ratio<0>>
+struct FlatGeometry : GeometryBase<MaxPowerOf2, LoadFactor, LowWater> {
+  static_assert(MaxPowerOf2 <= 40, "Reservation exceeds the address space");
+
+  template <typename Bucket, typename Allocator>
+  class Directory {
+   public:
+    Directory() {
+      // Anonymous mappings are zero filled, so every bucket starts as nullptr.
+      void* ptr = mmap(nullptr, kBytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (MAP_FAILED == ptr) throw std::bad_alloc();
+      buckets_ = static_cast<Bucket*>(ptr);
+      // Pages given back later keep the mapping until they are.
+      mapping_.reset(ptr, [](void* ptr) { munmap(ptr, kBytes); });
+    }
+
+    Directory(const Directory&) = delete;
+    Directory& operator=(const Directory&) = delete;
+
+    template <typename Reclaimer, typename HazardPointer>
+    Bucket* Get(size_t bucket_index, Reclaimer*, HazardPointer&) {
+      return &buckets_[bucket_index];
+    }
+
+    template <typename Reclaimer, typename HazardPointer>
+    Bucket& GetOrCreate(size_t bucket_index, Reclaimer* reclaimer,
+                        HazardPointer& hp) {
+      if constexpr (LowWater::num > 0) {
+        hp = HazardPointer(reclaimer, PageOf(bucket_index));
+      } else {
+        (void)reclaimer;
+        (void)hp;
+      }
+      return buckets_[bucket_index];
+    }
+
+    // A single level, see SegmentGeometry.
+    template <typename HazardPointer>
+    struct Cursor {};
+
+    static constexpr int kLevels = 1;
+
+    template <typename Reclaimer, typename HazardPointer>
+    void Prefetch(size_t bucket_index, int, Cursor<HazardPointer>&,
+                  Reclaimer*) {
+      __builtin_prefetch(&buckets_[bucket_index]);
+    }
+
+    template <typename HazardPointer>
+    Bucket* Get(size_t bucket_index, Cursor<HazardPointer>&) {
+      return &buckets_[bucket_index];
+    }
+
+    Bucket& GetFirst() { return buckets_[0]; }
+
+    // Give the pages which only hold buckets from first on and whose last
+    // bucket is in [begin, end) back to the system, once the threads which
+    // protected them let go, see SegmentGeometry. The pages read as nullptr
+    // again. A bucket a thread initializes after the table grows back, and
+    // before its page is given back, loses its head, which InitializeBucket
+    // finds in the list again.
+    template <typename Reclaimer>
+    void Shrink(size_t first, size_t begin, size_t end, Reclaimer& reclaimer) {
+      const size_t span = PageSize() / sizeof(Bucket);
+      for (size_t block = FlatGeometry::FirstShrinkBlock(first, begin, span);
+           block + span <= end; block += span) {
+        reclaimer.ReclaimLater(buckets_ + block,
+                               [mapping = mapping_](void* ptr) {
+                                 madvise(ptr, PageSize(), MADV_DONTNEED);
+                               });
+      }
+    }
+
+   private:
+    static_assert(std::is_trivially_destructible_v<Bucket>);
+    static constexpr size_t kBytes = sizeof(Bucket) << MaxPowerOf2;
+
+    static size_t PageSize() {
+      static const size_t page_size = sysconf(_SC_PAGESIZE);
+      return page_size;
+    }
+
+    void* PageOf(size_t bucket_index) const {
+      return reinterpret_cast<void*>(
+          reinterpret_cast<uintptr_t>(buckets_ + bucket_index) &
+          ~(PageSize() - 1));
+    }
+
+    Bucket* buckets_;
+    std::shared_ptr<void> mapping_;
+  };
+};
+
+// Up to 64^4 buckets, that is 2^23 items at the load factor of 0.5.
+typedef SegmentGeometry<4, 64> DefaultGeometry;
+
+// Stands in for HazardPointer under reclamation policies which need no
+// protection of single pointers.
+class NoHazardPointer {
+ public:
+  NoHazardPointer() {}
+  template <typename Reclaimer>
+  NoHazardPointer(Reclaimer*, void*) {}
+
+  void UnMark() {}
+};
+
+template <typename PerThreadReclaimer>
+class ReclamationDomain;
 
-template <typename K, typename V>
 class TableReclaimer;
 
-template <typename K, typename V, typename Hash = std::hash<K>>
+// Publishes ptr for its lifetime, or until UnMark, so that no reclaimer of
+// the domain frees it. The caller then checks that ptr is still reachable, it
+// may have been retired before it was published. A moved from one publishes
+// nothing.
+class HazardPointer {
+ public:
+  HazardPointer() : reclaimer_(nullptr), slot_(nullptr) {}
+  inline HazardPointer(TableReclaimer* reclaimer, void* ptr);
+  ~HazardPointer() { Release(); }
+
+  HazardPointer(const HazardPointer&) = delete;
+  HazardPointer& operator=(const HazardPointer&) = delete;
+
+  HazardPointer(HazardPointer&& other)
+      : reclaimer_(other.reclaimer_), slot_(other.slot_) {
+    other.slot_ = nullptr;
+  }
+
+  HazardPointer& operator=(HazardPointer&& other) {
+    if (this != &other) {
+      Release();
+      reclaimer_ = other.reclaimer_;
+      slot_ = other.slot_;
+      other.slot_ = nullptr;
+    }
+    return *this;
+  }
+
+  inline void UnMark();
+
+ private:
+  friend class TableReclaimer;
+
+  // Publishes one hazard pointer, it belongs to the reclaimer which added it
+  // and lives as long as the domain.
+  struct Slot {
+    std::atomic<void*> ptr{nullptr};
+    Slot* next = nullptr;
+  };
+
+  inline void Release();
+
+  TableReclaimer* reclaimer_;
+  Slot* slot_;
+};
+
+// Michael's hazard pointers, the reclaimer of one thread in one domain.
+// Retired nodes wait in a batch which is scanned against the hazard pointers
+// of the domain once it holds kScanFactor times as many nodes as there are
+// slots, so that a scan frees most of the batch and costs O(1) per node.
+class TableReclaimer {
+  template <typename>
+  friend class ReclamationDomain;
+  friend class HazardPointer;
+
+  typedef ::HazardPointer::Slot Slot;
+
+  struct Retired {
+    void* ptr;
+    std::function<void(void*)> func;
+  };
+
+  // Retired nodes of an exited thread.
+  struct Orphans {
+    std::vector<Retired> retired;
+    Orphans* next;
+  };
+
+ public:
+  typedef ::HazardPointer HazardPointer;
+  // A protected read must be validated, the pointer may have been retired
+  // before it was published.
+  static constexpr bool kHazardPointers = true;
+
+  // Hazard pointer slots and orphans of a domain.
+  struct Shared {
+    ~Shared() {
+      // Every table is gone, nothing is protected any more.
+      Orphans* orphans = this->orphans.load(std::memory_order_acquire);
+      while (orphans != nullptr) {
+        for (Retired& retired : orphans->retired) retired.func(retired.ptr);
+        Orphans* next = orphans->next;
+        delete orphans;
+        orphans = next;
+      }
+      Slot* slot = slots.load(std::memory_order_acquire);
+      while (slot != nullptr) {
+        Slot* next = slot->next;
+        delete slot;
+        slot = next;
+      }
+    }
+
+    std::atomic<Slot*> slots{nullptr};
+    std::atomic<size_t> slot_size{0};
+    std::atomic<Orphans*> orphans{nullptr};
+  };
+
+  // What an operation reads is protected pointer by pointer, its guard only
+  // passes what it retired on to be reclaimed once it ends, when it holds no
+  // hazard pointer any more.
+  class Guard {
+   public:
+    explicit Guard(TableReclaimer& reclaimer) : reclaimer_(reclaimer) {}
+    ~Guard() {
+      if (reclaimer_.pending_ == 0) return;
+      reclaimer_.pending_ = 0;
+      reclaimer_.ReclaimNoHazardPointer();
+    }
+
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+
+   private:
+    TableReclaimer& reclaimer_;
+  };
+
+  // Hazard pointers have no quiescent states.
+  void RegisterThread() {}
+  void UnregisterThread() {}
+  void Quiesce() {}
+
+  void ReclaimLater(void* const ptr, std::function<void(void*)>&& func) {
+    retired_.push_back({ptr, std::move(func)});
+    ++pending_;
+  }
+
+  // Scan once the batch is full.
+  void ReclaimNoHazardPointer() {
+    if (retired_.size() < scan_size_) return;
+    Scan();
+  }
+
+  // Scan now, whatever the batch holds, and free everything retired so far
+  // which no hazard pointer publishes. Must not be called from within a table
+  // operation.
+  void Flush() { Scan(); }
+
+ private:
+  static constexpr size_t kMinScanSize = 64;
+  // A scan reads every slot of the domain, it runs once this many times as
+  // many nodes are retired, so that it costs O(1) per node.
+  static constexpr size_t kScanFactor = 4;
+
+  explicit TableReclaimer(Shared& shared)
+      : shared_(shared), pending_(0), scan_size_(kMinScanSize) {}
+
+  // The domain goes, nothing is protected any more.
+  ~TableReclaimer() {
+    for (Retired& retired : retired_) retired.func(retired.ptr);
+  }
+
+  TableReclaimer(const TableReclaimer&) = delete;
+  TableReclaimer& operator=(const TableReclaimer&) = delete;
+
+  // Its thread exits, hand over what cannot be freed yet. Its slots publish
+  // nothing any more and stay with it for the thread which takes it over.
+  void Detach() {
+    Scan();
+    if (retired_.empty()) return;
+    Orphans* orphans = new Orphans{std::move(retired_), nullptr};
+    retired_.clear();
+    orphans->next = shared_.orphans.load(std::memory_order_relaxed);
+    while (!shared_.orphans.compare_exchange_weak(orphans->next, orphans,
+                                                  std::memory_order_release,
+                                                  std::memory_order_relaxed)) {
+    }
+  }
+
+  Slot* AcquireSlot() {
+    if (!free_slots_.empty()) {
+      Slot* slot = free_slots_.back();
+      free_slots_.pop_back();
+      return slot;
+    }
+    Slot* slot = new Slot;
+    Slot* head = shared_.slots.load(std::memory_order_relaxed);
+    do {
+      slot->next = head;
+    } while (!shared_.slots.compare_exchange_weak(head, slot,
+                                                  std::memory_order_release,
+                                                  std::memory_order_relaxed));
+    shared_.slot_size.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+  }
+
+  void ReleaseSlot(Slot* slot) {
+    slot->ptr.store(nullptr, std::memory_order_release);
+    free_slots_.push_back(slot);
+  }
+
+  // Adopt retired nodes of exited threads and free every retired node which
+  // no slot publishes. A node is unlinked before it is retired, a thread
+  // which publishes it after the fence fails to validate it.
+  void Scan() {
+    Orphans* orphans =
+        shared_.orphans.exchange(nullptr, std::memory_order_acquire);
+    while (orphans != nullptr) {
+      for (Retired& retired : orphans->retired) {
+        retired_.push_back(std::move(retired));
+      }
+      Orphans* next = orphans->next;
+      delete orphans;
+      orphans = next;
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::vector<void*> hazards;
+    for (Slot* slot = shared_.slots.load(std::memory_order_acquire);
+         slot != nullptr; slot = slot->next) {
+      void* ptr = slot->ptr.load(std::memory_order_acquire);
+      if (ptr != nullptr) hazards.push_back(ptr);
+    }
+    std::sort(hazards.begin(), hazards.end());
+    auto end = std::partition(
+        retired_.begin(), retired_.end(), [&hazards](const Retired& retired) {
+          return std::binary_search(hazards.begin(), hazards.end(),
+                                    retired.ptr);
+        });
+    for (auto it = end; it != retired_.end(); ++it) it->func(it->ptr);
+    retired_.erase(end, retired_.end());
+    UpdateScanSize();
+  }
+
+  // Scan again when the nodes still protected double, and no sooner than the
+  // read of the slots pays off.
+  void UpdateScanSize() {
+    scan_size_ = std::max(
+        {kMinScanSize,
+         kScanFactor * shared_.slot_size.load(std::memory_order_relaxed),
+         2 * retired_.size()});
+  }
+
+  Shared& shared_;
+  std::vector<Retired> retired_;
+  std::vector<Slot*> free_slots_;  // Slots of this reclaimer.
+  size_t pending_;  // Retired by the running operation.
+  size_t scan_size_;  // Scan once this many nodes are retired.
+};
+
+HazardPointer::HazardPointer(TableReclaimer* reclaimer, void* ptr)
+    : reclaimer_(reclaimer), slot_(reclaimer->AcquireSlot()) {
+  // Pairs with the fence in TableReclaimer::Scan.
+  slot_->ptr.store(ptr, std::memory_order_seq_cst);
+}
+
+void HazardPointer::UnMark() {
+  if (slot_ != nullptr) slot_->ptr.store(nullptr, std::memory_order_release);
+}
+
+void HazardPointer::Release() {
+  if (slot_ == nullptr) return;
+  reclaimer_->ReleaseSlot(slot_);
+  slot_ = nullptr;
+}
+
+// Epoch based reclamation, see Fraser's Practical lock-freedom. A thread
+// announces the epoch of its domain while it runs a table operation, a node
+// retired in epoch e is freed once the epoch has reached e + 2, by then every
+// operation which could have seen it has ended. The epoch only advances when
+// every announcing thread has caught up with it, so a stalled operation holds
+// back all reclamation in its domain. Retired nodes of an exiting thread are
+// handed over to the next thread which collects.
+//
+// With Quiescent set a thread may instead register, it then stays announced
+// until it unregisters and only renews its announcement when it calls
+// Quiesce, so a registered thread pays nothing per operation. Unregistered
+// threads announce per operation as above.
+template <bool Quiescent>
+class EpochReclaimer {
+  template <typename>
+  friend class ReclamationDomain;
+
+  struct Retired {
+    void* ptr;
+    std::function<void(void*)> func;
+    uint64_t epoch;
+  };
+
+  // Announcement slot of a reclaimer.
+  struct alignas(64) Record {
+    std::atomic<uint64_t> epoch{0};
+    Record* next = nullptr;
+  };
+
+  // Retired nodes of an exited thread.
+  struct Orphans {
+    std::vector<Retired> retired;
+    Orphans* next;
+  };
+
+ public:
+  typedef NoHazardPointer HazardPointer;
+  // Reads need no validation after they are protected.
+  static constexpr bool kHazardPointers = false;
+
+  // Epoch, announcements and orphans of a domain.
+  struct Shared {
+    ~Shared() {
+      // Every table is gone, nothing is protected any more.
+      Orphans* orphans = this->orphans.load(std::memory_order_acquire);
+      while (orphans != nullptr) {
+        for (Retired& retired : orphans->retired) retired.func(retired.ptr);
+        Orphans* next = orphans->next;
+        delete orphans;
+        orphans = next;
+      }
+      Record* record = records.load(std::memory_order_acquire);
+      while (record != nullptr) {
+        Record* next = record->next;
+        delete record;
+        record = next;
+      }
+    }
+
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<Record*> records{nullptr};
+    std::atomic<size_t> record_size{0};
+    std::atomic<Orphans*> orphans{nullptr};
+  };
+
+  // Announces the epoch for its lifetime, guards nest. The outermost one
+  // collects once enough has been retired, after it stopped announcing.
+  class Guard {
+   public:
+    explicit Guard(EpochReclaimer& reclaimer) : reclaimer_(reclaimer) {
+      reclaimer_.Enter();
+    }
+    ~Guard() {
+      if (reclaimer_.Exit()) reclaimer_.ReclaimNoHazardPointer();
+    }
+
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+
+   private:
+    EpochReclaimer& reclaimer_;
+  };
+
+  // Announce the thread until it unregisters, see Quiesce. No-ops without
+  // Quiescent.
+  void RegisterThread() {
+    if (!Quiescent || registered_) return;
+    registered_ = true;
+    Enter();
+  }
+
+  void UnregisterThread() {
+    if (!Quiescent || !registered_) return;
+    registered_ = false;
+    Exit();
+  }
+
+  // Declare that the registered thread holds no pointer into the tables of
+  // the domain, must not be called from within a table operation.
+  void Quiesce() {
+    if (!Quiescent || !registered_) return;
+    assert(depth_ == 1);
+    Announce();
+    ReclaimNoHazardPointer();
+  }
+
+  void ReclaimLater(void* const ptr, std::function<void(void*)>&& func) {
+    retired_.push_back(
+        {ptr, std::move(func), shared_.epoch.load(std::memory_order_seq_cst)});
+  }
+
+  // Try to advance the epoch and free what is safe to, once enough has been
+  // retired since the last time.
+  void ReclaimNoHazardPointer() {
+    if (retired_.size() < collect_size_) return;
+    Collect();
+    UpdateCollectSize();
+  }
+
+  // Free everything retired so far, which takes two advances of the epoch,
+  // unless another thread holds them back. Must not be called from within a
+  // table operation, on a registered thread it is also a quiescent state.
+  void Flush() {
+    assert(depth_ == (registered_ ? 1 : 0));
+    for (int i = 0; i < 2; ++i) {
+      if (registered_) Announce();
+      Collect();
+    }
+    UpdateCollectSize();
+  }
+
+ private:
+  static constexpr size_t kMinCollectSize = 64;
+  // A collection reads the record of every reclaimer, it runs once this many
+  // times as many nodes are retired, so that it costs O(1) per node.
+  static constexpr size_t kRecordFactor = 4;
+  // Announced epoch of a record is epoch << 1 | kActive, 0 when idle.
+  static constexpr uint64_t kActive = 1;
+
+  explicit EpochReclaimer(Shared& shared)
+      : shared_(shared),
+        record_(new Record),
+        depth_(0),
+        registered_(false),
+        collect_size_(kMinCollectSize) {
+    Record* head = shared_.records.load(std::memory_order_relaxed);
+    do {
+      record_->next = head;
+    } while (!shared_.records.compare_exchange_weak(
+        head, record_, std::memory_order_release, std::memory_order_relaxed));
+    shared_.record_size.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // The domain goes, no operation runs any more.
+  ~EpochReclaimer() {
+    for (Retired& retired : retired_) retired.func(retired.ptr);
+  }
+
+  EpochReclaimer(const EpochReclaimer&) = delete;
+  EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+
+  // Its thread exits, hand over what cannot be freed yet.
+  void Detach() {
+    UnregisterThread();
+    Collect();
+    if (!retired_.empty()) {
+      Orphans* orphans = new Orphans{std::move(retired_), nullptr};
+      retired_.clear();
+      orphans->next = shared_.orphans.load(std::memory_order_relaxed);
+      while (!shared_.orphans.compare_exchange_weak(
+          orphans->next, orphans, std::memory_order_release,
+          std::memory_order_relaxed)) {
+      }
+    }
+    UpdateCollectSize();
+  }
+
+  void Enter() {
+    if (depth_++ > 0) return;
+    Announce();
+  }
+
+  void Announce() {
+    uint64_t epoch = shared_.epoch.load(std::memory_order_relaxed);
+    record_->epoch.store(epoch << 1 | kActive, std::memory_order_relaxed);
+    // Pairs with the fence in TryAdvance, reads of the operation must not
+    // move above the announcement.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  // Whether the thread stopped announcing.
+  bool Exit() {
+    if (--depth_ > 0) return false;
+    record_->epoch.store(0, std::memory_order_release);
+    return true;
+  }
+
+  // Collect again when the retired nodes double, and no sooner than the scan
+  // of the records pays off.
+  void UpdateCollectSize() {
+    collect_size_ = std::max(
+        {kMinCollectSize,
+         kRecordFactor * shared_.record_size.load(std::memory_order_relaxed),
+         2 * retired_.size()});
+  }
+
+  // Advance the epoch if every announcing thread has caught up with it.
+  void TryAdvance() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t epoch = shared_.epoch.load(std::memory_order_relaxed);
+    for (Record* record = shared_.records.load(std::memory_order_acquire);
+         record != nullptr; record = record->next) {
+      uint64_t announced = record->epoch.load(std::memory_order_acquire);
+      if ((announced & kActive) && (announced >> 1) != epoch) return;
+    }
+    shared_.epoch.compare_exchange_strong(epoch, epoch + 1,
+                                          std::memory_order_acq_rel);
+  }
+
+  // Adopt retired nodes of exited threads, advance the epoch and free the
+  // nodes retired two epochs ago.
+  void Collect() {
+    Orphans* orphans =
+        shared_.orphans.exchange(nullptr, std::memory_order_acquire);
+    while (orphans != nullptr) {
+      for (Retired& retired : orphans->retired) {
+        retired_.push_back(std::move(retired));
+      }
+      Orphans* next = orphans->next;
+      delete orphans;
+      orphans = next;
+    }
+
+    TryAdvance();
+    uint64_t epoch = shared_.epoch.load(std::memory_order_acquire);
+    auto end = std::partition(
+        retired_.begin(), retired_.end(),
+        [epoch](const Retired& retired) { return retired.epoch + 2 > epoch; });
+    for (auto it = end; it != retired_.end(); ++it) it->func(it->ptr);
+    retired_.erase(end, retired_.end());
+  }
+
+  Shared& shared_;
+  Record* const record_;
+  int depth_;  // Nesting of guards, a registered thread counts as one.
+  bool registered_;
+  std::vector<Retired> retired_;
+  size_t collect_size_;  // Collect once this many nodes are retired.
+};
+
+// Reclamation state of one or more tables: what the threads share under a
+// policy, and the reclaimer of every thread which used it, taken over by
+// another thread once that one exits. A domain is a handle, copies share the
+// state, which lives until the last table and the last exiting thread let go
+// of it. Tables which share a domain also share the reclaimer of a thread, so
+// a scan covers all of them at once and a thread quiesces once for all of
+// them.
+template <typename PerThreadReclaimer>
+class ReclamationDomain {
+ public:
+  typedef PerThreadReclaimer ThreadReclaimer;
+
+  ReclamationDomain() : state_(std::make_shared<State>()) {}
+
+  // Reclaimer of the calling thread, taken over on first use.
+  ThreadReclaimer& GetReclaimer() {
+    ThreadCache& cache = thread_cache_;
+    if (cache.last_id == state_->id) return *cache.last;
+    return Lookup(cache);
+  }
+
+  // Quiescent states of the calling thread, see EpochReclaimer.
+  void RegisterThread() { GetReclaimer().RegisterThread(); }
+  void UnregisterThread() { GetReclaimer().UnregisterThread(); }
+  void Quiesce() { GetReclaimer().Quiesce(); }
+  // Reclaim what the calling thread retired, see the Flush of the reclaimer.
+  void Flush() { GetReclaimer().Flush(); }
+
+ private:
+  // A thread drops domains which are gone once it caches this many.
+  static constexpr size_t kMinPruneSize = 16;
+
+  struct Slot {
+    explicit Slot(typename ThreadReclaimer::Shared& shared)
+        : reclaimer(shared) {}
+
+    ThreadReclaimer reclaimer;
+    std::atomic<bool> in_use{true};
+    Slot* next = nullptr;
+  };
+
+  struct State {
+    State() : id(next_id_.fetch_add(1, std::memory_order_relaxed)) {}
+
+    ~State() {
+      // Reclaimers go before what they share, they free what they retired.
+      Slot* slot = slots.load(std::memory_order_acquire);
+      while (slot != nullptr) {
+        Slot* next = slot->next;
+        delete slot;
+        slot = next;
+      }
+    }
+
+    // Take over the reclaimer of an exited thread, or add one.
+    Slot* Acquire() {
+      for (Slot* slot = slots.load(std::memory_order_acquire);
+           slot != nullptr; slot = slot->next) {
+        bool in_use = false;
+        if (!slot->in_use.load(std::memory_order_relaxed) &&
+            slot->in_use.compare_exchange_strong(in_use, true,
+                                                 std::memory_order_acquire)) {
+          return slot;
+        }
+      }
+      Slot* slot = new Slot(shared);
+      Slot* head = slots.load(std::memory_order_relaxed);
+      do {
+        slot->next = head;
+      } while (!slots.compare_exchange_weak(head, slot,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed));
+      return slot;
+    }
+
+    // The thread which took over slot exits.
+    void Release(Slot* slot) {
+      slot->reclaimer.Detach();
+      slot->in_use.store(false, std::memory_order_release);
+    }
+
+    typename ThreadReclaimer::Shared shared;
+    std::atomic<Slot*> slots{nullptr};
+    const uint64_t id;  // Unlike the address, never reused.
+  };
+
+  // Reclaimers the calling thread took over, released when it exits.
+  struct ThreadCache {
+    struct Entry {
+      std::weak_ptr<State> state;
+      Slot* slot;
+    };
+
+    ~ThreadCache() {
+      for (auto& [id, entry] : entries) {
+        if (std::shared_ptr<State> state = entry.state.lock()) {
+          state->Release(entry.slot);
+        }
+      }
+    }
+
+    uint64_t last_id = 0;  // Domain of the last lookup, ids start at 1.
+    ThreadReclaimer* last = nullptr;
+    std::unordered_map<uint64_t, Entry> entries;
+    size_t prune_size = kMinPruneSize;
+  };
+
+  ThreadReclaimer& Lookup(ThreadCache& cache) {
+    auto it = cache.entries.find(state_->id);
+    if (it == cache.entries.end()) {
+      if (cache.entries.size() >= cache.prune_size) {
+        for (auto entry = cache.entries.begin();
+             entry != cache.entries.end();) {
+          if (entry->second.state.expired()) {
+            entry = cache.entries.erase(entry);
+          } else {
+            ++entry;
+          }
+        }
+        cache.prune_size = std::max(kMinPruneSize, 2 * cache.entries.size());
+      }
+      it = cache.entries
+               .emplace(state_->id, typename ThreadCache::Entry{
+                                        state_, state_->Acquire()})
+               .first;
+    }
+    cache.last_id = state_->id;
+    cache.last = &it->second.slot->reclaimer;
+    return *cache.last;
+  }
+
+  static inline std::atomic<uint64_t> next_id_{1};
+  static inline thread_local ThreadCache thread_cache_;
+
+  std::shared_ptr<State> state_;
+};
+
+// A reclamation policy decides when memory unlinked from the table may be
+// freed. Its Domain holds the reclamation state of one or more tables and
+// hands each thread its ThreadReclaimer, which besides ReclaimLater and
+// ReclaimNoHazardPointer provides a HazardPointer to protect a single
+// pointer, a Guard which spans a table operation and reclaims what it retired
+// once enough has piled up, kHazardPointers, whether a protected read must be
+// validated, Flush and the quiescent state calls.
+
+// Michael's hazard pointers, the default: a search publishes every node it
+// visits, but memory waiting to be reclaimed stays bounded even when threads
+// stall.
+struct HazardPointerReclamation {
+  typedef ReclamationDomain<TableReclaimer> Domain;
+};
+
+// Epochs, see EpochReclaimer: an operation announces itself once and a search
+// publishes nothing, but a stalled operation holds back reclamation.
+struct EpochReclamation {
+  typedef ReclamationDomain<EpochReclaimer<false>> Domain;
+};
+
+// Quiescent states, for threads which run a loop with natural points where
+// they hold nothing from the table: a thread registers once and calls Quiesce
+// at those points, operations in between do no reclamation work at all. A
+// registered thread which stops calling Quiesce holds back reclamation, so
+// unregister before blocking.
+struct QuiescentReclamation {
+  typedef ReclamationDomain<EpochReclaimer<true>> Domain;
+};
+
+// Buffered output to a file descriptor for LockFreeHashTable::SaveTo. Once a
+// write fails every later one does too.
+class FileWriter {
+ public:
+  explicit FileWriter(int fd)
+      : fd_(fd), buffer_(new char[kBufferSize]), size_(0), ok_(true) {}
+
+  FileWriter(const FileWriter&) = delete;
+  FileWriter& operator=(const FileWriter&) = delete;
+
+  bool Write(const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    while (ok_ && size > 0) {
+      if (kBufferSize == size_) Flush();
+      size_t n = std::min(size, kBufferSize - size_);
+      std::memcpy(buffer_.get() + size_, bytes, n);
+      size_ += n;
+      bytes += n;
+      size -= n;
+    }
+    return ok_;
+  }
+
+  // Write out what the buffer holds.
+  bool Flush() {
+    for (size_t done = 0; ok_ && done < size_;) {
+      ssize_t n = ::write(fd_, buffer_.get() + done, size_ - done);
+      if (n > 0) {
+        done += n;
+      } else if (n < 0 && EINTR != errno) {
+        ok_ = false;
+      }
+    }
+    size_ = 0;
+    return ok_;
+  }
+
+ private:
+  static constexpr size_t kBufferSize = 1 << 20;
+
+  int fd_;
+  std::unique_ptr<char[]> buffer_;
+  size_t size_;
+  bool ok_;
+};
+
+// Buffered input from a file descriptor for LockFreeHashTable::LoadFrom, a
+// read past the end fails.
+class FileReader {
+ public:
+  explicit FileReader(int fd)
+      : fd_(fd), buffer_(new char[kBufferSize]), begin_(0), end_(0) {}
+
+  FileReader(const FileReader&) = delete;
+  FileReader& operator=(const FileReader&) = delete;
+
+  bool Read(void* data, size_t size) {
+    char* bytes = static_cast<char*>(data);
+    while (size > 0) {
+      if (begin_ == end_ && !Fill()) return false;
+      size_t n = std::min(size, end_ - begin_);
+      std::memcpy(bytes, buffer_.get() + begin_, n);
+      begin_ += n;
+      bytes += n;
+      size -= n;
+    }
+    return true;
+  }
+
+ private:
+  static constexpr size_t kBufferSize = 1 << 20;
+
+  bool Fill() {
+    while (true) {
+      ssize_t n = ::read(fd_, buffer_.get(), kBufferSize);
+      if (n > 0) {
+        begin_ = 0;
+        end_ = n;
+        return true;
+      }
+      if (0 == n || EINTR != errno) return false;
+    }
+  }
+
+  int fd_;
+  std::unique_ptr<char[]> buffer_;
+  size_t begin_;
+  size_t end_;
+};
+
+// Writes keys and values for SaveTo and reads them back for LoadFrom:
+// trivially copyable types byte for byte in the byte order of the machine,
+// strings as their length and then their characters. A serializer for other
+// types has the same two members, Save returns false and Load nullopt when
+// the file fails. It may also have MinSize, the fewest bytes Save writes for
+// a T, which LoadFrom uses to bound the items a file can hold.
+struct BinarySerializer {
+  template <typename T>
+  static constexpr size_t MinSize() {
+    if constexpr (std::is_same_v<T, std::string>) {
+      return sizeof(uint64_t);
+    } else {
+      return sizeof(T);
+    }
+  }
+
+  template <typename T>
+  bool Save(FileWriter& out, const T& value) const {
+    if constexpr (std::is_same_v<T, std::string>) {
+      uint64_t size = value.size();
+      return out.Write(&size, sizeof(size)) && out.Write(value.data(), size);
+    } else {
+      static_assert(std::is_trivially_copyable_v<T>,
+                    "T requires a serializer of its own");
+      return out.Write(&value, sizeof(T));
+    }
+  }
+
+  // A string grows by at most kChunkSize characters per read, so that a
+  // corrupt length fails at the end of the file rather than allocating it.
+  template <typename T>
+  std::optional<T> Load(FileReader& in) const {
+    if constexpr (std::is_same_v<T, std::string>) {
+      uint64_t size;
+      if (!in.Read(&size, sizeof(size))) return std::nullopt;
+      std::string value;
+      while (value.size() < size) {
+        size_t begin = value.size();
+        value.resize(begin + std::min<uint64_t>(size - begin, kChunkSize));
+        if (!in.Read(value.data() + begin, value.size() - begin)) {
+          return std::nullopt;
+        }
+      }
+      return value;
+    } else {
+      static_assert(std::is_trivially_copyable_v<T>,
+                    "T requires a serializer of its own");
+      T value;
+      if (!in.Read(&value, sizeof(T))) return std::nullopt;
+      return value;
+    }
+  }
+
+ private:
+  static constexpr size_t kChunkSize = 1 << 16;
+};
+
+class LockFreeHashTableTest;
+
+template <typename K, typename V, typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>,
+          typename Allocator = DefaultAllocator,
+          typename Geometry = DefaultGeometry,
+          typename Reclamation = HazardPointerReclamation,
+          bool Snapshots = false>
 class LockFreeHashTable {
   static_assert(std::is_copy_constructible_v<K>, "K requires copy constructor");
   static_assert(std::is_copy_constructible_v<V>, "V requires copy constructor");
-  friend TableReclaimer<K, V>;
+  typedef typename Reclamation::Domain::ThreadReclaimer ThreadReclaimer;
+  typedef typename ThreadReclaimer::HazardPointer HazardPointer;
+  typedef typename ThreadReclaimer::Guard Guard;
+  friend LockFreeHashTableTest;
 
   struct Node;
   struct DummyNode;
   struct RegularNode;
-  struct Segment;
+  template <typename Q>
+  struct Probe;
+  struct Version;
+  struct SnapshotRecord;
+
+  // Where the last search of a Cursor stopped, the node before the key it
+  // looked for, protected by hp.
+  struct Finger {
+    Node* node = nullptr;
+    HazardPointer hp;
+  };
 
   typedef size_t HashKey;
   typedef size_t BucketIndex;
-  typedef size_t SegmentIndex;
   typedef std::atomic<DummyNode*> Bucket;
+  typedef typename Geometry::template Directory<Bucket, Allocator> Directory;
+
+  // Position of a walk over the list, see NextNode. It starts on a head,
+  // protected by head_hp unless it is head_, which counts as visited.
+  struct Walk {
+    explicit Walk(Node* head)
+        : prev(head),
+          last_reverse_hash(head->reverse_hash),
+          last_hash(head->hash) {}
+
+    // The last visited node, protected by prev_hp, or by head_hp when the
+    // walk started over from it.
+    Node* prev;
+    HazardPointer head_hp, prev_hp, cur_hp;
+    // Position of the last visited node, and the number of visited nodes
+    // there.
+    HashKey last_reverse_hash;
+    HashKey last_hash;
+    size_t last_count = 1;
+    bool started_over = false;
+    size_t to_skip = 0;  // Visited nodes at the last position left to skip.
+  };
 
  public:
-  LockFreeHashTable() : power_of_2_(1), size_(0), hash_func_(Hash()) {
+  // Reclamation state, see ReclamationDomain.
+  typedef typename Reclamation::Domain Domain;
+
+  LockFreeHashTable() : LockFreeHashTable(Domain()) {}
+
+  // Reclaim memory in domain, shared with the other tables which use it.
+  explicit LockFreeHashTable(const Domain& domain)
+      : power_of_2_(1),
+        shrink_busy_(false),
+        shrink_next_(0),
+        hash_func_(Hash()),
+        key_equal_(KeyEqual()),
+        domain_(domain),
+        clock_(1),
+        snapshot_records_(nullptr),
+        retained_(0) {
     // Initialize first bucket
-    int level = 1;
-    Segment* segments = segments_;  // Point to current segment.
-    while (level++ <= kMaxLevel - 2) {
-      Segment* sub_segments = NewSegments(level);
-      segments[0].data.store(sub_segments, std::memory_order_release);
-      segments = sub_segments;
-    }
-
-    Bucket* buckets = NewBuckets();
-    segments[0].data.store(buckets, std::memory_order_release);
-
-    DummyNode* head = new DummyNode(0);
-    buckets[0].store(head, std::memory_order_release);
+    DummyNode* head = NewObject<DummyNode>(0);
+    directory_.GetFirst().store(head, std::memory_order_release);
     head_ = head;
   }
 
+  // Start with the buckets for capacity items, see Reserve.
+  explicit LockFreeHashTable(size_t capacity, int n_threads = 0,
+                             const Domain& domain = Domain())
+      : LockFreeHashTable(domain) {
+    Reserve(capacity, n_threads);
+  }
+
   ~LockFreeHashTable() {
     Node* p = head_;
     while (p != nullptr) {
@@ -63,6 +1642,12 @@ class LockFreeHashTable {
       p = p->next.load(std::memory_order_acquire);
       tmp->Release();
     }
+    SnapshotRecord* record = snapshot_records_.load(std::memory_order_acquire);
+    while (record != nullptr) {
+      SnapshotRecord* next = record->next;
+      DeleteObject(record);
+      record = next;
+    }
   }
 
   LockFreeHashTable(const LockFreeHashTable& other) = delete;
@@ -71,70 +1656,310 @@ class LockFreeHashTable {
   LockFreeHashTable& operator=(LockFreeHashTable&& other) = delete;
 
   bool Insert(const K& key, const V& value) {
-    RegularNode* new_node = new RegularNode(key, value, hash_func_);
-    DummyNode* head = GetBucketHeadByHash(new_node->hash);
-    return InsertRegularNode(head, new_node);
+    RegularNode* new_node = NewObject<RegularNode>(key, value, hash_func_);
+    return InsertRegularNode(new_node);
   }
 
   bool Insert(K&& key, const V& value) {
-    RegularNode* new_node = new RegularNode(std::move(key), value, hash_func_);
-    DummyNode* head = GetBucketHeadByHash(new_node->hash);
-    return InsertRegularNode(head, new_node);
+    RegularNode* new_node =
+        NewObject<RegularNode>(std::move(key), value, hash_func_);
+    return InsertRegularNode(new_node);
   }
 
   bool Insert(const K& key, V&& value) {
-    RegularNode* new_node = new RegularNode(key, std::move(value), hash_func_);
-    DummyNode* head = GetBucketHeadByHash(new_node->hash);
-    return InsertRegularNode(head, new_node);
+    RegularNode* new_node =
+        NewObject<RegularNode>(key, std::move(value), hash_func_);
+    return InsertRegularNode(new_node);
   }
 
   bool Insert(K&& key, V&& value) {
-    RegularNode* new_node =
-        new RegularNode(std::move(key), std::move(value), hash_func_);
-    DummyNode* head = GetBucketHeadByHash(new_node->hash);
-    return InsertRegularNode(head, new_node);
+    RegularNode* new_node = NewObject<RegularNode>(
+        std::move(key), std::move(value), hash_func_);
+    return InsertRegularNode(new_node);
   }
 
+  // Insert every item as Insert does, a later item overrides an earlier one
+  // of an equal key. The items are sorted into list order, so that the buckets
+  // of the batch are resolved once each and an item is searched from where the
+  // one before it went. Return the number of keys which were not in the table.
+  size_t InsertBatch(std::span<const std::pair<K, V>> items);
+
   bool Delete(const K& key) {
-    HashKey hash = hash_func_(key);
-    DummyNode* head = GetBucketHeadByHash(hash);
-    RegularNode delete_node(key, hash_func_);
-    return DeleteNode(head, &delete_node);
+    return DeleteNode(Probe<K>(hash_func_(key), &key));
   }
 
   bool Find(const K& key, V& value) {
-    HashKey hash = hash_func_(key);
-    DummyNode* head = GetBucketHeadByHash(hash);
-    RegularNode find_node(key, hash_func_);
-    return FindNode(head, &find_node, value);
+    return FindNode(Probe<K>(hash_func_(key), &key), value);
   };
 
-  size_t size() const { return size_.load(std::memory_order_relaxed); }
+  // Find every key as Find does and store its value, or nullopt when it is
+  // not in the table, at the same index of values, which is as long as keys.
+  // Keys are looked up in groups whose lookups take turns: each reads one
+  // level of the directory, its head or one node of its bucket, and
+  // prefetches what it reads next before the next lookup takes its turn, so
+  // that their cache misses overlap instead of adding up, however long their
+  // chains are. Return the number of keys found.
+  size_t FindBatch(std::span<const K> keys,
+                   std::span<std::optional<V>> values);
+
+  // Heterogeneous lookup, like C++20 std::unordered_map::find, available when
+  // both Hash::is_transparent and KeyEqual::is_transparent are defined. Hash
+  // must give a Q the same hash as the equivalent K.
+  template <typename Q, typename H = Hash, typename E = KeyEqual,
+            typename = typename H::is_transparent,
+            typename = typename E::is_transparent>
+  bool Delete(const Q& key) {
+    return DeleteNode(Probe<Q>(hash_func_(key), &key));
+  }
 
- private:
-  size_t bucket_size() const {
-    return 1 << power_of_2_.load(std::memory_order_relaxed);
+  template <typename Q, typename H = Hash, typename E = KeyEqual,
+            typename = typename H::is_transparent,
+            typename = typename E::is_transparent>
+  bool Find(const Q& key, V& value) {
+    return FindNode(Probe<Q>(hash_func_(key), &key), value);
   }
 
-  Segment* NewSegments(int level) {
-    Segment* segments = new Segment[kSegmentSize];
-    for (int i = 0; i < kSegmentSize; ++i) {
-      segments[i].level = level;
-      segments[i].data.store(nullptr, std::memory_order_release);
+  // A finger into the table for the thread which creates it. Every operation
+  // through a Cursor starts its search from the node where the last one
+  // stopped, if that node is in the bucket of the key and before it, instead
+  // of from the bucket head, so that a run of keys which are close in list
+  // order, such as keys sorted by hash, costs a short walk each. A Cursor
+  // holds a Guard for its lifetime, under EpochReclamation it holds back
+  // reclamation like an operation which lasts as long, and under
+  // QuiescentReclamation the thread must not Quiesce while it lives.
+  class Cursor {
+   public:
+    explicit Cursor(LockFreeHashTable& table)
+        : table_(table), guard_(table.domain_.GetReclaimer()) {}
+
+    Cursor(const Cursor&) = delete;
+    Cursor& operator=(const Cursor&) = delete;
+
+    bool Insert(const K& key, const V& value) {
+      return table_.InsertRegularNode(
+          NewObject<RegularNode>(key, value, table_.hash_func_), &finger_);
+    }
+
+    bool Find(const K& key, V& value) {
+      return table_.FindNode(Probe<K>(table_.hash_func_(key), &key), value,
+                             &finger_);
     }
-    return segments;
+
+    bool Delete(const K& key) {
+      return table_.DeleteNode(Probe<K>(table_.hash_func_(key), &key),
+                               &finger_);
+    }
+
+   private:
+    LockFreeHashTable& table_;
+    Guard guard_;
+    Finger finger_;  // Released before guard_.
+  };
+
+  // Call fn(key, value) on every item in list order, without blocking
+  // writers. The scan is weakly consistent: an item present throughout is
+  // visited once, one inserted or deleted meanwhile may or may not be, and
+  // an item updated meanwhile shows one of its values, see NextNode. fn runs
+  // inside the scan, it may call operations of the table but must not
+  // Quiesce or Flush.
+  template <typename F>
+  void ForEach(F&& fn) {
+    auto& reclaimer = domain_.GetReclaimer();
+    ForEachNode([&](Node* node) {
+      if (node->IsDummy()) return;
+      RegularNode* regular = static_cast<RegularNode*>(node);
+      VisitValue(regular, reclaimer,
+                 [&](const V& value) { fn(regular->key, value); });
+    });
+  }
+
+  // Call fn(key, value) on every item as ForEach does, on n_threads threads
+  // including the calling one, so fn must be safe to call concurrently. The
+  // list is split at bucket heads into runs of whole buckets which the
+  // threads take in turn, so that each scans its own part of the list.
+  template <typename F>
+  void ParallelForEach(int n_threads, F&& fn);
+
+  // Iteration over the items in list order for the thread which creates it,
+  // as weakly consistent as ForEach. Like a Cursor it holds a Guard for its
+  // lifetime.
+  class Iterator {
+   public:
+    explicit Iterator(LockFreeHashTable& table)
+        : table_(table),
+          guard_(table.domain_.GetReclaimer()),
+          walk_(table.head_) {}
+
+    Iterator(const Iterator&) = delete;
+    Iterator& operator=(const Iterator&) = delete;
+
+    // Copy the next item out, return false once every item was visited.
+    bool Next(K& key, V& value) {
+      while (Node* node = table_.NextNode(walk_)) {
+        if (node->IsDummy()) continue;
+        RegularNode* regular = static_cast<RegularNode*>(node);
+        if (!table_.LoadValue(regular, table_.domain_.GetReclaimer(),
+                              value)) {
+          continue;
+        }
+        key = regular->key;
+        return true;
+      }
+      return false;
+    }
+
+   private:
+    LockFreeHashTable& table_;
+    Guard guard_;
+    Walk walk_;  // Released before guard_.
+  };
+
+  // The table as it was when the Snapshot was taken, while writers go on,
+  // available when Snapshots is set. Taking one costs an increment of the
+  // clock and an announcement. While it lives, writes keep the versions it
+  // may read: an update keeps the value it replaced and a Delete leaves a
+  // tombstone in the list, so what it holds grows with the writes to
+  // distinct keys since it was taken, no further. Releasing it sweeps the
+  // whole table for what no snapshot needs any more, if writes kept any.
+  class Snapshot {
+   public:
+    explicit Snapshot(LockFreeHashTable& table)
+        : table_(table), record_(table.AcquireSnapshot(&version_)) {
+      static_assert(Snapshots, "The table does not keep versions");
+    }
+
+    ~Snapshot() { table_.ReleaseSnapshot(record_); }
+
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    bool Find(const K& key, V& value) {
+      return table_.FindVersion(Probe<K>(table_.hash_func_(key), &key), value,
+                                version_);
+    }
+
+    // Call fn(key, value) on every item of the snapshot in list order. It
+    // walks the list as ForEach does, see NextNode, so it may miss an item
+    // whose key shares the full hash with one deleted meanwhile.
+    template <typename F>
+    void ForEach(F&& fn) {
+      auto& reclaimer = table_.domain_.GetReclaimer();
+      table_.ForEachNode([&](Node* node) {
+        if (node->IsDummy()) return;
+        RegularNode* regular = static_cast<RegularNode*>(node);
+        table_.VisitVersion(regular, version_, reclaimer, [&](const V& value) {
+          fn(regular->key, value);
+        });
+      });
+    }
+
+   private:
+    LockFreeHashTable& table_;
+    uint64_t version_;  // Versions stamped up to it are visible.
+    SnapshotRecord* record_;
+  };
+
+  // Write every item to fd in list order, return false when a write fails.
+  // The items are those ForEach visits, so only a table no thread writes to
+  // meanwhile is saved as it is, else the count may change and SaveTo
+  // returns false as well. The file holds a header with the item count, then
+  // each item as a 1 byte and its key and value, then a 0 byte and the number
+  // of items written.
+  template <typename Serializer = BinarySerializer>
+  bool SaveTo(int fd, const Serializer& serializer = Serializer());
+
+  // Add the items which SaveTo wrote to fd, a later item overrides an
+  // earlier one of an equal key. No other thread may use the table
+  // meanwhile. The buckets for the items are sized up front and, as the
+  // items come in list order, linked into the list in one pass along with
+  // the heads of all buckets, without CAS or searches. The count of the
+  // header is only trusted as far as the file can hold that many items. An
+  // item out of order, which a Hash other than the saving table's leads to,
+  // is inserted as Insert does. Return false when the file is not one SaveTo
+  // wrote, ends early or holds another number of items than its header
+  // says, the items read so far stay in the table.
+  template <typename Serializer = BinarySerializer>
+  bool LoadFrom(int fd, const Serializer& serializer = Serializer());
+
+  // Number of items, a single load which may lag behind, see StripedCounter.
+  size_t size() const { return size_.Load(); }
+
+  // Number of items, exact when no writer runs, it reads one cache line per
+  // counter stripe.
+  size_t size_exact() const { return size_.LoadExact(); }
+
+  // Raise the bucket size to hold capacity items without growing, so that
+  // loading them skips the doublings on the way. With n_threads > 0 every
+  // bucket is also initialized up front by that many threads, so that inserts
+  // find their heads in place instead of initializing parents recursively.
+  // Does not grow a table while it shrinks, and a table which shrinks may
+  // give the buckets back on Delete.
+  void Reserve(size_t capacity, int n_threads = 0);
+
+  // Shape of the split-ordered list, gathered in one pass while writers run.
+  // A chain is the run of items of one bucket at the current bucket size.
+  struct Stats {
+    size_t size;           // Items seen.
+    size_t bucket_size;    // Buckets.
+    size_t dummy_nodes;    // Initialized buckets.
+    double load_factor;    // Items per bucket.
+    double average_chain;  // Items per non-empty bucket.
+    size_t max_chain;      // Items in the fullest bucket.
+  };
+
+  Stats GetStats();
+
+  // Quiescent states of the calling thread, see QuiescentReclamation. Quiesce
+  // must be called outside of table operations and covers every table of the
+  // domain. No-ops under the other reclamation policies, so the same loop
+  // runs with any of them.
+  void RegisterThread() { domain_.RegisterThread(); }
+  void UnregisterThread() { domain_.UnregisterThread(); }
+  void Quiesce() { domain_.Quiesce(); }
+
+  // Free what the calling thread retired in the domain as far as the policy
+  // allows, outside of table operations. Operations reclaim on their own
+  // once enough is retired, in proportion to the threads of the domain.
+  void Flush() { domain_.Flush(); }
+
+  // The reclamation domain, to construct tables which share it.
+  Domain domain() const { return domain_; }
+
+ private:
+  // Set in power_of_2_ while Shrink runs, so that the table neither grows nor
+  // shrinks again meanwhile. Nothing waits for it to be cleared.
+  static constexpr size_t kShrinking = size_t(1) << 63;
+
+  // Buckets a step of Shrink empties, see ShrinkStep.
+  static constexpr size_t kShrinkStep = 64;
+
+  // Lookups which take turns in FindBatch, enough to cover the latency of a
+  // miss while what they prefetch stays well within L1.
+  static constexpr size_t kFindBatchGroup = 16;
+
+  size_t bucket_size() const {
+    return size_t(1) << (power_of_2_.load(std::memory_order_relaxed) &
+                         ~kShrinking);
   }
 
-  Bucket* NewBuckets() {
-    Bucket* buckets = new Bucket[kSegmentSize];
-    for (int i = 0; i < kSegmentSize; ++i) {
-      buckets[i].store(nullptr, std::memory_order_release);
+  // Initialize bucket recursively, the returned head is protected by head_hp.
+  DummyNode* InitializeBucket(BucketIndex bucket_index,
+                              HazardPointer& head_hp);
+
+  // Raise the bucket size to 2^power, unless it is larger already or a Shrink
+  // runs, which grows the table to its size once it ends.
+  void Grow(size_t power) {
+    size_t old_power = power_of_2_.load(std::memory_order_relaxed);
+    while (!(old_power & kShrinking) && old_power < power &&
+           !power_of_2_.compare_exchange_weak(old_power, power,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed)) {
     }
-    return buckets;
   }
 
-  // Initialize bucket recursively.
-  DummyNode* InitializeBucket(BucketIndex bucket_index);
+  // Initialize the buckets in [1, end) level by level on n_threads threads.
+  void InitializeBuckets(BucketIndex end, int n_threads);
+  void InitializeBucketRange(BucketIndex begin, BucketIndex end);
 
   // When the table size is 2^i , a logical table bucket b contains items whose
   // keys k maintain k mod 2^i = b. When the size becomes 2^i+1, the items of
@@ -147,78 +1972,390 @@ class LockFreeHashTable {
             bucket_index);
   };
 
+  // Heads of buckets are removed by Shrink, so a head is only used while a
+  // hazard pointer protects it.
+
   // Get the head node of bucket, if bucket not exist then return nullptr or
   // return head.
-  DummyNode* GetBucketHeadByIndex(BucketIndex bucket_index);
+  DummyNode* GetBucketHeadByIndex(BucketIndex bucket_index,
+                                  HazardPointer& head_hp);
 
   // Get the head node of bucket, if bucket not exist then initialize it and
   // return head.
-  DummyNode* GetBucketHeadByHash(HashKey hash) {
+  DummyNode* GetBucketHeadByHash(HashKey hash, HazardPointer& head_hp) {
     BucketIndex bucket_index = (hash & (bucket_size() - 1));
-    DummyNode* head = GetBucketHeadByIndex(bucket_index);
+    DummyNode* head = GetBucketHeadByIndex(bucket_index, head_hp);
     if (nullptr == head) {
-      head = InitializeBucket(bucket_index);
+      head = InitializeBucket(bucket_index, head_hp);
     }
     return head;
   }
 
-  // Harris' OrderedListBasedset with Michael's hazard pointer to manage memory,
-  // See also https://github.com/bhhbazinga/LockFreeLinkedList.
-  bool InsertRegularNode(DummyNode* head, RegularNode* new_node);
-  bool InsertDummyNode(DummyNode* head, DummyNode* new_node,
-                       DummyNode** real_head);
-  bool DeleteNode(DummyNode* head, Node* delete_node);
-  bool FindNode(DummyNode* head, RegularNode* find_node, V& value) {
+  // Reclaimer to protect bucket arrays with, none when the table never
+  // shrinks.
+  ThreadReclaimer* GetBucketReclaimer() {
+    if constexpr (Geometry::kShrinkable) {
+      return &domain_.GetReclaimer();
+    } else {
+      return nullptr;
+    }
+  }
+
+  DummyNode* LoadBucketHead(Bucket& bucket, HazardPointer& head_hp) {
+    DummyNode* head = bucket.load(std::memory_order_acquire);
+    if constexpr (!Geometry::kShrinkable) {
+      (void)head_hp;
+      return head;
+    }
+    auto& reclaimer = domain_.GetReclaimer();
+    while (nullptr != head) {
+      head_hp = HazardPointer(&reclaimer, head);
+      DummyNode* again = bucket.load(std::memory_order_acquire);
+      if (again == head) break;
+      head = again;
+    }
+    return head;
+  }
+
+  // Halve the buckets of a table which has 2^power buckets, the heads of the
+  // upper half are removed from the list and their bucket arrays, segments
+  // or pages released. Lookups use the lower half at once, the upper half is
+  // emptied kShrinkStep buckets at a time by the Inserts and Deletes which
+  // follow, see ShrinkStep, so that none of them takes more than a step.
+  void Shrink(size_t power);
+  // Take the next step of a running Shrink, unless another thread takes one.
+  void ShrinkStep();
+  // Take steps until no Shrink runs, for callers which size the table.
+  void FinishShrink();
+  // Empty the next buckets of the running Shrink, the caller holds
+  // shrink_busy_.
+  void EmptyNextBuckets();
+  void DeleteDummyNode(DummyNode* head);
+
+  // Let a running Shrink take a step, every Insert does.
+  void HelpShrink() {
+    if constexpr (Geometry::kShrinkable) {
+      if (power_of_2_.load(std::memory_order_relaxed) & kShrinking) {
+        ShrinkStep();
+      }
+    }
+  }
+
+  // Start of a search for probe. That is the node of finger, which then hands
+  // its hazard pointer over to start_hp, when it is in the bucket of probe
+  // and before it, nodes of an equal hash are not in order of their keys,
+  // else the head of the bucket.
+  template <typename Q>
+  Node* GetSearchStart(const Probe<Q>& probe, Finger* finger,
+                       HazardPointer& start_hp) {
+    if (nullptr != finger && nullptr != finger->node) {
+      Node* node = finger->node;
+      finger->node = nullptr;
+      const size_t mask = bucket_size() - 1;
+      if ((node->hash & mask) == (probe.hash & mask) &&
+          node->reverse_hash < probe.reverse_hash) {
+        start_hp = std::move(finger->hp);
+        return node;
+      }
+    }
+    return GetBucketHeadByHash(probe.hash, start_hp);
+  }
+
+  // Leave finger at prev, where a search from start stopped. prev is
+  // protected by start_hp when it is start, else by prev_hp.
+  static void SetFinger(Finger* finger, Node* start, HazardPointer& start_hp,
+                        Node* prev, HazardPointer& prev_hp) {
+    if (nullptr == finger) return;
+    finger->node = prev;
+    finger->hp = std::move(prev == start ? start_hp : prev_hp);
+  }
+
+  // Search the next time from prev, where the last search from start
+  // stopped, instead of from start, see SetFinger.
+  static void Advance(Node** start_ptr, HazardPointer& start_hp, Node* prev,
+                      HazardPointer& prev_hp) {
+    if (prev == *start_ptr) return;
+    *start_ptr = prev;
+    start_hp = std::move(prev_hp);
+  }
+
+  // Copy the current value of node out, into a V or an optional<V>, see
+  // VisitValue.
+  template <typename T>
+  bool LoadValue(RegularNode* node, ThreadReclaimer& reclaimer, T& value) {
+    return VisitValue(node, reclaimer,
+                      [&value](const V& current) { value = current; });
+  }
+
+  // Call fn with the current value of node, return false when it has none,
+  // which only happens under Snapshots, where a deleted item may stay in the
+  // list.
+  template <typename F>
+  bool VisitValue(RegularNode* node, ThreadReclaimer& reclaimer, F&& fn) {
+    if constexpr (Snapshots) {
+      HazardPointer version_hp;
+      Version* version = LoadVersion(node, reclaimer, version_hp);
+      if (Removed() == version) return false;
+      Stamp(version);
+      if (!version->value) return false;
+      fn(*version->value);
+      return true;
+    } else {
+      node->VisitValue(reclaimer, std::forward<F>(fn));
+      return true;
+    }
+  }
+
+  // Outcome of StoreValue.
+  enum class Store { kUpdated, kRevived, kRemoved };
+
+  // Move the value of other node, which is not visible to other threads, into
+  // node, which holds the same key. Under Snapshots it is pushed as the new
+  // version of node, which revives a deleted item, unless node is being
+  // removed, then other keeps it.
+  Store StoreValue(RegularNode* node, ThreadReclaimer& reclaimer,
+                   RegularNode* other);
+
+  // Logically delete node by marking node->next, unless it is already.
+  void MarkNode(Node* node) {
+    Node* next = node->get_next();
+    while (!is_marked_reference(next) &&
+           !node->next.compare_exchange_weak(next, get_marked_reference(next),
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed)) {
+    }
+  }
+
+  // Versions of a Snapshots table, see Snapshot.
+
+  Version* LoadVersion(RegularNode* node, ThreadReclaimer& reclaimer,
+                       HazardPointer& version_hp) {
+    Version* version;
+    do {
+      version = node->value.load(std::memory_order_acquire);
+      version_hp = HazardPointer(&reclaimer, version);
+    } while (version != node->value.load(std::memory_order_acquire));
+    return version;
+  }
+
+  // The version of a published Version. The first thread which reads it, its
+  // writer included, stamps it with the clock, so that it takes effect before
+  // its writer returns and every snapshot sees it alike.
+  uint64_t Stamp(Version* version) {
+    uint64_t stamped = version->version.load(std::memory_order_acquire);
+    if (0 != stamped) return stamped;
+    uint64_t now = clock_.load(std::memory_order_seq_cst);
+    if (version->version.compare_exchange_strong(stamped, now,
+                                                 std::memory_order_acq_rel)) {
+      return now;
+    }
+    return stamped;
+  }
+
+  // Stamp the version of node which was just linked, see Stamp.
+  void StampValue(RegularNode* node, ThreadReclaimer& reclaimer) {
+    HazardPointer version_hp;
+    Version* version = LoadVersion(node, reclaimer, version_hp);
+    if (Removed() != version) Stamp(version);
+  }
+
+  // Version of the oldest live snapshot, or of the next one when there is
+  // none. A snapshot which is taken meanwhile gets a larger version than any
+  // stamped so far.
+  uint64_t OldestSnapshot() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t oldest = clock_.load(std::memory_order_seq_cst);
+    for (SnapshotRecord* record =
+             snapshot_records_.load(std::memory_order_acquire);
+         record != nullptr; record = record->next) {
+      uint64_t version = record->version.load(std::memory_order_seq_cst);
+      if (0 != version) oldest = std::min(oldest, version);
+    }
+    return oldest;
+  }
+
+  SnapshotRecord* AcquireSnapshot(uint64_t* version);
+  void ReleaseSnapshot(SnapshotRecord* record);
+
+  // Drop the versions older than version, which is stamped and protected,
+  // that no snapshot of oldest or later reads. Return whether it keeps any.
+  bool Trim(Version* version, uint64_t oldest, ThreadReclaimer& reclaimer);
+
+  // Retire version and the ones it replaced. Each link is taken by exchange,
+  // so a version which threads trim concurrently is retired once.
+  void RetireVersions(Version* version, ThreadReclaimer& reclaimer) {
+    while (nullptr != version) {
+      Version* prev =
+          version->prev.exchange(nullptr, std::memory_order_acq_rel);
+      reclaimer.ReclaimLater(version, [](void* ptr) {
+        DeleteObject(static_cast<Version*>(ptr));
+      });
+      version = prev;
+    }
+  }
+
+  // Push a tombstone onto node, return false when it holds no value. Set
+  // *unlink when the tombstone is older than every snapshot, then node is
+  // removed and marked and the caller unlinks it.
+  bool EraseValue(RegularNode* node, ThreadReclaimer& reclaimer,
+                  bool* unlink);
+
+  // Remove node, whose head is the tombstone, if no snapshot of oldest or
+  // later sees a value of it, return whether it did.
+  bool TryRemove(RegularNode* node, Version* tombstone, uint64_t oldest,
+                 ThreadReclaimer& reclaimer);
+
+  // Trim every node and remove the deleted ones, as far as the live
+  // snapshots allow, once writes kept versions for snapshots.
+  void Sweep();
+
+  // Call fn with the value of node in the snapshot of version, the newest one
+  // stamped up to it, return false when it has none.
+  template <typename F>
+  bool VisitVersion(RegularNode* node, uint64_t version,
+                    ThreadReclaimer& reclaimer, F&& fn);
+
+  template <typename Q>
+  bool FindVersion(const Probe<Q>& probe, V& value, uint64_t version) {
+    auto& reclaimer = domain_.GetReclaimer();
+    Guard guard(reclaimer);
     Node* prev;
     Node* cur;
-    HazardPointer prev_hp, cur_hp;
-    bool found = SearchNode(head, find_node, &prev, &cur, prev_hp, cur_hp);
-    auto& reclaimer = TableReclaimer<K, V>::GetInstance();
-    if (found) {
-      V* value_ptr;
-      V* temp;
-      do {
-        // When find and insert concurrently value may be deleted,
-        // see InsertRegularNode, so value must be marked as hazard.
-        value_ptr = static_cast<RegularNode*>(cur)->value.load(
-            std::memory_order_consume);
-        temp = value_ptr;
-        value_ptr = static_cast<RegularNode*>(cur)->value.load(
-            std::memory_order_consume);
-      } while (temp != value_ptr);
-      reclaimer.ReclaimNoHazardPointer();
-      value = *value_ptr;
+    HazardPointer head_hp, prev_hp, cur_hp;
+    Node* head = GetBucketHeadByHash(probe.hash, head_hp);
+    return SearchNode(&head, head_hp, probe, &prev, &cur, prev_hp, cur_hp) &&
+           VisitVersion(static_cast<RegularNode*>(cur), version, reclaimer,
+                        [&value](const V& current) { value = current; });
+  }
+
+  // See SaveTo.
+  static constexpr uint32_t kFileMagic = 0x5448464c;  // "LFHT"
+  static constexpr uint32_t kFileFormat = 1;
+  // LoadFrom sizes the buckets for at most this many items of a file whose
+  // size it cannot tell, more grow the table as Insert does.
+  static constexpr uint64_t kMaxLoadHint = 1 << 20;
+
+  // Fewest bytes Serializer writes for a T, 0 when it does not tell.
+  template <typename Serializer, typename T>
+  static constexpr size_t MinSavedSize() {
+    if constexpr (requires { Serializer::template MinSize<T>(); }) {
+      return Serializer::template MinSize<T>();
+    } else {
+      return 0;
     }
+  }
+
+  // Link node into the list after *prev, which comes before it, past the
+  // nodes in between, and set *prev to it, for LoadFrom. Return false when
+  // a node of the same position is in the list, or *prev is not before it.
+  bool AppendNode(Node* node, Node** prev);
+
+  // Harris' OrderedListBasedset with Michael's hazard pointer to manage memory,
+  // See also https://github.com/bhhbazinga/LockFreeLinkedList. A retry after
+  // a failed CAS searches on from the node before the key, not from the
+  // bucket head. Operations of a Cursor pass its finger.
+  bool InsertRegularNode(RegularNode* new_node, Finger* finger = nullptr);
+  bool InsertDummyNode(Node* parent_head, HazardPointer& parent_hp,
+                       DummyNode* new_head, DummyNode** real_head,
+                       HazardPointer& real_head_hp);
+  template <typename Q>
+  bool DeleteNode(const Probe<Q>& probe, Finger* finger = nullptr);
+  template <typename Q>
+  bool FindNode(const Probe<Q>& probe, V& value, Finger* finger = nullptr) {
+    auto& reclaimer = domain_.GetReclaimer();
+    Guard guard(reclaimer);
+    Node* prev;
+    Node* cur;
+    HazardPointer head_hp, prev_hp, cur_hp;
+    Node* head = GetSearchStart(probe, finger, head_hp);
+    bool found =
+        SearchNode(&head, head_hp, probe, &prev, &cur, prev_hp, cur_hp) &&
+        LoadValue(static_cast<RegularNode*>(cur), reclaimer, value);
+    SetFinger(finger, head, head_hp, prev, prev_hp);
     return found;
   }
 
-  // Traverse list begin with head until encounter nullptr or the first node
-  // which is greater than or equals to the given search_node.
-  bool SearchNode(DummyNode* head, Node* search_node, Node** prev_ptr,
-                  Node** cur_ptr, HazardPointer& prev_hp,
-                  HazardPointer& cur_hp);
+  // Traverse list begin with start until encounter nullptr or the first node
+  // which is greater than or equals to the given probe. start is a bucket
+  // head or a regular node whose hash is before the one of probe, protected
+  // by start_hp. If a head turns out to be removed by Shrink, start over from
+  // the head of its parent bucket, if a regular node turns out to be deleted,
+  // from the head of the bucket of probe.
+  template <typename Q>
+  bool SearchNode(Node** start_ptr, HazardPointer& start_hp,
+                  const Probe<Q>& probe, Node** prev_ptr, Node** cur_ptr,
+                  HazardPointer& prev_hp, HazardPointer& cur_hp);
+
+  // SearchNode one node at a time, so that FindBatch can take turns between
+  // the searches of a group. Between steps *prev_ptr is protected, by
+  // start_hp or prev_hp, and *cur_ptr is what its next pointed to.
+  enum class Search { kMore, kFound, kMissing };
+  // Start the search at *prev_ptr again, or at the start of the search when
+  // it was deleted.
+  template <typename Q>
+  void ResumeSearch(Node** start_ptr, HazardPointer& start_hp,
+                    const Probe<Q>& probe, Node** prev_ptr, Node** cur_ptr);
+  // Take *cur_ptr, return kMore while the search goes on.
+  template <typename Q>
+  Search SearchStep(Node** start_ptr, HazardPointer& start_hp,
+                    const Probe<Q>& probe, Node** prev_ptr, Node** cur_ptr,
+                    HazardPointer& prev_hp, HazardPointer& cur_hp);
+
+  // Call fn on every node in list order, see NextNode.
+  template <typename F>
+  void ForEachNode(F&& fn) {
+    Guard guard(domain_.GetReclaimer());
+    Walk walk(head_);
+    fn(walk.prev);
+    while (Node* node = NextNode(walk)) fn(node);
+  }
 
-  // Compare two nodes according to their reverse_hash and the key.
-  bool Less(Node* node1, Node* node2) const {
-    if (node1->reverse_hash != node2->reverse_hash) {
-      return node1->reverse_hash < node2->reverse_hash;
+  // Call fn on every node of the bucket bucket_index of a table of
+  // partitions buckets, those whose hash ends in bucket_index, which are
+  // adjacent in list order, see NextNode.
+  template <typename F>
+  void ForEachNodeInBucket(BucketIndex bucket_index, size_t partitions,
+                           F&& fn);
+
+  // Step walk to the next node in list order, skipping deleted ones and
+  // helping to unlink them, return nullptr at the end of the list. The
+  // returned node stays protected until the next step, the caller holds a
+  // Guard throughout. Writers may run meanwhile, a node present throughout is
+  // visited once. When the node it stands on is deleted the walk starts over
+  // from the head of its bucket and skips the nodes up to where it was, then
+  // nodes which share the full hash with a node deleted meanwhile may be
+  // missed.
+  Node* NextNode(Walk& walk);
+
+  // Nodes are ordered by reverse_hash and then by the full hash, regular nodes
+  // with the same hash stay in insertion order, so the key is only compared
+  // for equality and a search walks past the ones whose key differs.
+  template <typename Q>
+  bool Less(Node* node, const Probe<Q>& probe) const {
+    if (node->reverse_hash != probe.reverse_hash) {
+      return node->reverse_hash < probe.reverse_hash;
     }
 
-    if (node1->IsDummy() || node2->IsDummy()) {
+    if (node->IsDummy()) {
       // When initialize bucket concurrently, that could happen.
       return false;
     }
 
-    return static_cast<RegularNode*>(node1)->key <
-           static_cast<RegularNode*>(node2)->key;
+    if (node->hash != probe.hash) return node->hash < probe.hash;
+    return !key_equal_(static_cast<RegularNode*>(node)->key, *probe.key);
   }
 
-  bool GreaterOrEquals(Node* node1, Node* node2) const {
-    return !(Less(node1, node2));
+  template <typename Q>
+  bool GreaterOrEquals(Node* node, const Probe<Q>& probe) const {
+    return !(Less(node, probe));
   }
 
-  bool Equals(Node* node1, Node* node2) const {
-    return !Less(node1, node2) && !Less(node2, node1);
+  // Only valid for a node which is not Less than probe, so an equal hash
+  // means an equal key.
+  template <typename Q>
+  bool Equals(Node* node, const Probe<Q>& probe) const {
+    if (node->reverse_hash != probe.reverse_hash) return false;
+    return node->IsDummy() || node->hash == probe.hash;
   }
 
   bool is_marked_reference(Node* next) const {
@@ -234,7 +2371,22 @@ class LockFreeHashTable {
                                    ~0x1);
   }
 
-  static void OnDeleteNode(void* ptr) { delete static_cast<Node*>(ptr); }
+  static void OnDeleteNode(void* ptr) { static_cast<Node*>(ptr)->Release(); }
+
+  // Every node, value and directory array goes through Allocator.
+  template <typename T, typename... Args>
+  static T* NewObject(Args&&... args) {
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+                  "Over-aligned types are not supported");
+    return new (Allocator::Allocate(sizeof(T)))
+        T(std::forward<Args>(args)...);
+  }
+
+  template <typename T>
+  static void DeleteObject(T* ptr) {
+    ptr->~T();
+    Allocator::Deallocate(ptr, sizeof(T));
+  }
 
   struct Node {
     Node(HashKey hash_, bool dummy)
@@ -242,26 +2394,38 @@ class LockFreeHashTable {
           reverse_hash(dummy ? DummyKey(hash) : RegularKey(hash)),
           next(nullptr) {}
 
-    virtual void Release() = 0;
-
-    virtual ~Node() {}
+    // Nodes carry no vtable, the low bit of reverse_hash tells a regular node
+    // from a dummy one and selects the destructor to run.
+    void Release() {
+      if (IsDummy()) {
+        DeleteObject(static_cast<DummyNode*>(this));
+      } else {
+        DeleteObject(static_cast<RegularNode*>(this));
+      }
+    }
 
-    HashKey Reverse(HashKey hash) const {
-      return reverse8bits_[hash & 0xff] << 56 |
-             reverse8bits_[(hash >> 8) & 0xff] << 48 |
-             reverse8bits_[(hash >> 16) & 0xff] << 40 |
-             reverse8bits_[(hash >> 24) & 0xff] << 32 |
-             reverse8bits_[(hash >> 32) & 0xff] << 24 |
-             reverse8bits_[(hash >> 40) & 0xff] << 16 |
-             reverse8bits_[(hash >> 48) & 0xff] << 8 |
-             reverse8bits_[(hash >> 56) & 0xff];
+    // Reverse the bits of hash, clang has a builtin for it, otherwise swap the
+    // bytes and then the nibbles, bit pairs and bits within each byte.
+    static HashKey Reverse(HashKey hash) {
+#if defined(__clang__)
+      return __builtin_bitreverse64(hash);
+#else
+      hash = __builtin_bswap64(hash);
+      hash = (hash & 0x0f0f0f0f0f0f0f0f) << 4 |
+             (hash >> 4 & 0x0f0f0f0f0f0f0f0f);
+      hash = (hash & 0x3333333333333333) << 2 |
+             (hash >> 2 & 0x3333333333333333);
+      hash = (hash & 0x5555555555555555) << 1 |
+             (hash >> 1 & 0x5555555555555555);
+      return hash;
+#endif
     }
-    HashKey RegularKey(HashKey hash) const {
+    static HashKey RegularKey(HashKey hash) {
       return Reverse(hash | 0x8000000000000000);
     }
-    HashKey DummyKey(HashKey hash) const { return Reverse(hash); }
+    static HashKey DummyKey(HashKey hash) { return Reverse(hash); }
 
-    virtual bool IsDummy() const { return (reverse_hash & 0x1) == 0; }
+    bool IsDummy() const { return (reverse_hash & 0x1) == 0; }
     Node* get_next() const { return next.load(std::memory_order_acquire); }
 
     const HashKey hash;
@@ -272,205 +2436,423 @@ class LockFreeHashTable {
   // Head node of bucket
   struct DummyNode : Node {
     DummyNode(BucketIndex bucket_index) : Node(bucket_index, true) {}
-    ~DummyNode() override {}
-
-    void Release() override { delete this; }
+  };
 
-    bool IsDummy() const override { return true; }
+  // Small trivially copyable values live inline in the node and are updated
+  // in place with a single atomic store, so inserting costs one allocation
+  // and finding costs no extra pointer chase. Other values are stored out of
+  // line and replaced by swapping the pointer.
+  template <typename T, typename = void>
+  struct IsInlineValue : std::false_type {};
+  template <typename T>
+  struct IsInlineValue<T, std::enable_if_t<std::is_trivially_copyable_v<T>>>
+      : std::bool_constant<std::atomic<T>::is_always_lock_free> {};
+  static constexpr bool kInlineValue = !Snapshots && IsInlineValue<V>::value;
+
+  // Under Snapshots a node holds the versions of its value, newest first, see
+  // Snapshot. A Delete pushes a tombstone, the node stays in the list until
+  // no snapshot can see a value of it, then its head is set to removed_ and
+  // it is unlinked.
+  struct Version {
+    Version() {}  // A tombstone.
+    template <typename T>
+    explicit Version(T&& value_) : value(std::forward<T>(value_)) {}
+
+    const std::optional<V> value;      // None in a tombstone.
+    std::atomic<uint64_t> version{0};  // 0 until stamped, see Stamp.
+    std::atomic<Version*> prev{nullptr};  // The version it replaced.
   };
 
+  typedef std::conditional_t<
+      Snapshots, std::atomic<Version*>,
+      std::conditional_t<kInlineValue, std::atomic<V>, std::atomic<V*>>>
+      ValueSlot;
+
   struct RegularNode : Node {
     RegularNode(const K& key_, const V& value_, const Hash& hash_func)
-        : Node(hash_func(key_), false), key(key_), value(new V(value_)) {}
+        : Node(hash_func(key_), false), key(key_), value(NewValue(value_)) {}
     RegularNode(const K& key_, V&& value_, const Hash& hash_func)
         : Node(hash_func(key_), false),
           key(key_),
-          value(new V(std::move(value_))) {}
+          value(NewValue(std::move(value_))) {}
     RegularNode(K&& key_, const V& value_, const Hash& hash_func)
         : Node(hash_func(key_), false),
           key(std::move(key_)),
-          value(new V(value_)) {}
+          value(NewValue(value_)) {}
     RegularNode(K&& key_, V&& value_, const Hash& hash_func)
         : Node(hash_func(key_), false),
           key(std::move(key_)),
-          value(new V(std::move(value_))) {}
-
-    RegularNode(const K& key_, const Hash& hash_func)
-        : Node(hash_func(key_), false), key(key_), value(nullptr) {}
-
-    ~RegularNode() override {
-      V* ptr = value.load(std::memory_order_consume);
-      if (ptr != nullptr)
-        delete ptr;  // If update a node, value of this node is nullptr.
+          value(NewValue(std::move(value_))) {}
+
+    ~RegularNode() {
+      if constexpr (Snapshots) {
+        Version* version = value.load(std::memory_order_relaxed);
+        if (Removed() == version) return;
+        while (version != nullptr) {
+          Version* prev = version->prev.load(std::memory_order_relaxed);
+          DeleteObject(version);
+          version = prev;
+        }
+      } else if constexpr (!kInlineValue) {
+        V* ptr = value.load(std::memory_order_consume);
+        if (ptr != nullptr)
+          DeleteObject(ptr);  // If update a node, value of this node is
+                              // nullptr.
+      }
     }
 
-    void Release() override { delete this; }
-
-    bool IsDummy() const override { return false; }
-
-    const K key;
-    std::atomic<V*> value;
-  };
-
-  struct Segment {
-    Segment() : level(1), data(nullptr) {}
-    explicit Segment(int level_) : level(level_), data(nullptr) {}
-
-    Bucket* get_sub_buckets() const {
-      return static_cast<Bucket*>(data.load(std::memory_order_consume));
+    template <typename T>
+    static auto NewValue(T&& value_) {
+      if constexpr (Snapshots) {
+        return NewObject<Version>(std::forward<T>(value_));
+      } else if constexpr (kInlineValue) {
+        return V(std::forward<T>(value_));
+      } else {
+        return NewObject<V>(std::forward<T>(value_));
+      }
     }
 
-    Segment* get_sub_segments() const {
-      return static_cast<Segment*>(data.load(std::memory_order_consume));
+    // Call fn with the current value, an out of line one is not copied.
+    // Without Snapshots, see the VisitValue of the table.
+    template <typename F>
+    void VisitValue(ThreadReclaimer& reclaimer, F&& fn) const {
+      if constexpr (kInlineValue) {
+        (void)reclaimer;
+        fn(static_cast<const V&>(value.load(std::memory_order_acquire)));
+      } else {
+        // When find and insert concurrently value may be deleted,
+        // see InsertRegularNode, so value must be marked as hazard.
+        V* value_ptr;
+        HazardPointer value_hp;
+        do {
+          value_ptr = value.load(std::memory_order_acquire);
+          value_hp = HazardPointer(&reclaimer, value_ptr);
+        } while (value_ptr != value.load(std::memory_order_acquire));
+        fn(static_cast<const V&>(*value_ptr));
+      }
     }
 
-    ~Segment() {
-      void* ptr = data.load(std::memory_order_consume);
-      if (nullptr == ptr) return;
-
-      if (level == kMaxLevel - 1) {
-        Bucket* buckets = static_cast<Bucket*>(ptr);
-        delete[] buckets;
+    // Move the value of other node into this node, other node must not be
+    // visible to other threads. Without Snapshots, see the StoreValue of the
+    // table.
+    void StoreValue(ThreadReclaimer& reclaimer, RegularNode* other) {
+      if constexpr (kInlineValue) {
+        (void)reclaimer;
+        value.store(other->value.load(std::memory_order_relaxed),
+                    std::memory_order_release);
       } else {
-        Segment* sub_segments = static_cast<Segment*>(ptr);
-        delete[] sub_segments;
+        V* new_value = other->value.load(std::memory_order_relaxed);
+        V* old_value = value.exchange(new_value, std::memory_order_release);
+        reclaimer.ReclaimLater(
+            old_value, [](void* ptr) { DeleteObject(static_cast<V*>(ptr)); });
+        other->value.store(nullptr, std::memory_order_relaxed);
       }
     }
 
-    int level;                // Level of segment.
-    std::atomic<void*> data;  // If level == kMaxLevel then data point to
-                              // buckets else data point to segments.
+    const K key;
+    ValueSlot value;
   };
 
-  std::atomic<size_t> power_of_2_;   // Bucket size == 2^power_of_2_.
-  std::atomic<size_t> size_;         // Item size.
-  Hash hash_func_;                   // Hash function.
-  Segment segments_[kSegmentSize];   // Top level sengments.
-  static size_t reverse8bits_[256];  // Lookup table for reverse bits quickly.
-  DummyNode* head_;                  // Head of linkedlist.
-  static Reclaimer::HazardPointerList global_hp_list_;
-};
+  // What SearchNode looks for, lookups build it on the stack instead of a
+  // whole RegularNode so that they neither copy the key nor allocate. Q is
+  // K or, for heterogeneous lookup, any type KeyEqual accepts along with K.
+  template <typename Q>
+  struct Probe {
+    Probe(HashKey hash_, const Q* key_)
+        : hash(hash_), reverse_hash(Node::RegularKey(hash_)), key(key_) {}
+    explicit Probe(Node* node)
+        : hash(node->hash),
+          reverse_hash(node->reverse_hash),
+          key(node->IsDummy() ? nullptr
+                              : &static_cast<RegularNode*>(node)->key) {}
 
-template <typename K, typename V, typename Hash>
-Reclaimer::HazardPointerList LockFreeHashTable<K, V, Hash>::global_hp_list_;
+    const HashKey hash;
+    const HashKey reverse_hash;
+    const Q* const key;  // Null when looking for a dummy node.
+  };
 
-template <typename K, typename V>
-class TableReclaimer : public Reclaimer {
-  friend LockFreeHashTable<K, V>;
+  // Head of the versions of a node which is unlinked or about to be.
+  static inline Version removed_;
 
- private:
-  TableReclaimer(HazardPointerList& hp_list) : Reclaimer(hp_list) {}
-  ~TableReclaimer() override = default;
+  static Version* Removed() { return &removed_; }
 
-  static TableReclaimer<K, V>& GetInstance() {
-    thread_local static TableReclaimer reclaimer(
-        LockFreeHashTable<K, V>::global_hp_list_);
-    return reclaimer;
-  }
+  // Announcement of a live Snapshot, see OldestSnapshot.
+  struct SnapshotRecord {
+    std::atomic<uint64_t> version{0};  // 0 when idle.
+    std::atomic<bool> in_use{true};
+    SnapshotRecord* next = nullptr;
+  };
+
+  std::atomic<size_t> power_of_2_;   // Bucket size == 2^power_of_2_, may
+                                     // carry kShrinking.
+  std::atomic<bool> shrink_busy_;    // Held by the thread taking a step.
+  BucketIndex shrink_next_;          // Next bucket Shrink empties.
+  StripedCounter size_;              // Item size.
+  Hash hash_func_;                   // Hash function.
+  KeyEqual key_equal_;               // Key equality predicate.
+  Directory directory_;              // Buckets.
+  DummyNode* head_;                  // Head of linkedlist.
+  Domain domain_;                    // Reclamation state.
+  // Under Snapshots only.
+  std::atomic<uint64_t> clock_;      // Version of the next snapshot.
+  std::atomic<SnapshotRecord*> snapshot_records_;
+  std::atomic<size_t> retained_;     // Writes which kept versions for
+                                     // snapshots since the last Sweep.
 };
 
-// Fast reverse bits using Lookup Table.
-#define R2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
-#define R4(n) R2(n), R2(n + 2 * 16), R2(n + 1 * 16), R2(n + 3 * 16)
-#define R6(n) R4(n), R4(n + 2 * 4), R4(n + 1 * 4), R4(n + 3 * 4)
-// Lookup Table that store the reverse of each 8bit number.
-template <typename K, typename V, typename Hash>
-size_t LockFreeHashTable<K, V, Hash>::reverse8bits_[256] = {R6(0), R6(2), R6(1),
-                                                            R6(3)};
-
-template <typename K, typename V, typename Hash>
-typename LockFreeHashTable<K, V, Hash>::DummyNode*
-LockFreeHashTable<K, V, Hash>::InitializeBucket(BucketIndex bucket_index) {
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+typename LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry,
+                           Reclamation, Snapshots>::DummyNode*
+LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                  Snapshots>::InitializeBucket(BucketIndex bucket_index,
+                                               HazardPointer& head_hp) {
   BucketIndex parent_index = GetBucketParent(bucket_index);
-  DummyNode* parent_head = GetBucketHeadByIndex(parent_index);
+  HazardPointer parent_hp;
+  DummyNode* parent_head = GetBucketHeadByIndex(parent_index, parent_hp);
   if (nullptr == parent_head) {
-    parent_head = InitializeBucket(parent_index);
-  }
-
-  int level = 1;
-  Segment* segments = segments_;  // Point to current segment.
-  while (level++ <= kMaxLevel - 2) {
-    Segment& cur_segment =
-        segments[(bucket_index / static_cast<SegmentIndex>(pow(
-                                     kSegmentSize, kMaxLevel - level + 1))) %
-                 kSegmentSize];
-    Segment* sub_segments = cur_segment.get_sub_segments();
-    if (nullptr == sub_segments) {
-      // Try allocate segments.
-      sub_segments = NewSegments(level);
-      void* expected = nullptr;
-      if (!cur_segment.data.compare_exchange_strong(
-              expected, sub_segments, std::memory_order_release)) {
-        delete[] sub_segments;
-        sub_segments = static_cast<Segment*>(expected);
-      }
-    }
-    segments = sub_segments;
+    parent_head = InitializeBucket(parent_index, parent_hp);
   }
 
-  Segment& cur_segment = segments[(bucket_index / kSegmentSize) % kSegmentSize];
-  Bucket* buckets = cur_segment.get_sub_buckets();
-  if (nullptr == buckets) {
-    // Try allocate buckets.
-    void* expected = nullptr;
-    buckets = NewBuckets();
-    if (!cur_segment.data.compare_exchange_strong(expected, buckets,
-                                                  std::memory_order_release)) {
-      delete[] buckets;
-      buckets = static_cast<Bucket*>(expected);
+  HazardPointer bucket_hp;
+  Bucket& bucket =
+      directory_.GetOrCreate(bucket_index, GetBucketReclaimer(), bucket_hp);
+  if constexpr (Geometry::kShrinkable) {
+    // A Shrink started since the caller chose the bucket, it empties the
+    // bucket and releases its array or page once bucket_hp, published before
+    // this load, no longer protects it. The parent holds its keys now.
+    size_t power = power_of_2_.load(std::memory_order_seq_cst) & ~kShrinking;
+    if (bucket_index >> power != 0) {
+      head_hp = std::move(parent_hp);
+      return parent_head;
     }
   }
-
-  Bucket& bucket = buckets[bucket_index % kSegmentSize];
-  DummyNode* head = bucket.load(std::memory_order_consume);
+  DummyNode* head = LoadBucketHead(bucket, head_hp);
   if (nullptr == head) {
-    // Try allocate dummy head.
-    head = new DummyNode(bucket_index);
+    // Try allocate dummy head, Shrink may remove it as soon as it is stored
+    // into bucket.
+    head = NewObject<DummyNode>(bucket_index);
+    if constexpr (Geometry::kShrinkable) {
+      head_hp = HazardPointer(GetBucketReclaimer(), head);
+    }
     DummyNode* real_head;  // If insert failed, real_head is the head of bucket.
-    if (InsertDummyNode(parent_head, head, &real_head)) {
+    if (InsertDummyNode(parent_head, parent_hp, head, &real_head, head_hp)) {
       // Dummy head must be inserted into the list before storing into bucket.
       bucket.store(head, std::memory_order_release);
     } else {
-      delete head;
+      DeleteObject(head);
       head = real_head;
+      // The head of a store which went to a bucket array or page a Shrink
+      // dropped is in the list but in no bucket, publish it. Take it back
+      // when a Shrink which started meanwhile drops the bucket or removed
+      // the head, it must not stay in the bucket once that Shrink unlinks it.
+      DummyNode* empty = nullptr;
+      if (bucket.compare_exchange_strong(empty, head,
+                                         std::memory_order_acq_rel) &&
+          ((bucket_index >> (power_of_2_.load(std::memory_order_seq_cst) &
+                             ~kShrinking)) != 0 ||
+           is_marked_reference(head->get_next()))) {
+        bucket.compare_exchange_strong(head, nullptr,
+                                       std::memory_order_acq_rel);
+        head = real_head;
+      }
     }
   }
   return head;
 }
 
-template <typename K, typename V, typename Hash>
-typename LockFreeHashTable<K, V, Hash>::DummyNode*
-LockFreeHashTable<K, V, Hash>::GetBucketHeadByIndex(BucketIndex bucket_index) {
-  int level = 1;
-  const Segment* segments = segments_;
-  while (level++ <= kMaxLevel - 2) {
-    segments =
-        segments[(bucket_index / static_cast<SegmentIndex>(pow(
-                                     kSegmentSize, kMaxLevel - level + 1))) %
-                 kSegmentSize]
-            .get_sub_segments();
-    if (nullptr == segments) return nullptr;
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+typename LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry,
+                           Reclamation, Snapshots>::DummyNode*
+LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                  Snapshots>::GetBucketHeadByIndex(BucketIndex bucket_index,
+                                                   HazardPointer& head_hp) {
+  HazardPointer bucket_hp;
+  Bucket* bucket =
+      directory_.Get(bucket_index, GetBucketReclaimer(), bucket_hp);
+  if (nullptr == bucket) return nullptr;
+  return LoadBucketHead(*bucket, head_hp);
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+void LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::Reserve(size_t capacity, int n_threads) {
+  FinishShrink();
+  Grow(Geometry::TargetPowerOf2(capacity));
+  if (n_threads > 0) InitializeBuckets(bucket_size(), n_threads);
+}
+
+// Buckets of [2^i, 2^(i+1)) have all their parents below 2^i, so once the
+// levels below are done each of them takes a short search from its parent's
+// head and no recursion. A level is split among threads only when it is
+// large enough to pay for starting them.
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+void LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::InitializeBuckets(BucketIndex end,
+                                                     int n_threads) {
+  static const BucketIndex kMinBucketsPerThread = 4096;
+  for (BucketIndex begin = 1; begin < end; begin <<= 1) {
+    BucketIndex level_end = std::min(begin << 1, end);
+    BucketIndex chunk =
+        std::max((level_end - begin + n_threads - 1) / n_threads,
+                 kMinBucketsPerThread);
+    std::vector<std::thread> threads;
+    for (BucketIndex i = begin + chunk; i < level_end; i += chunk) {
+      threads.emplace_back(&LockFreeHashTable::InitializeBucketRange, this, i,
+                           std::min(i + chunk, level_end));
+    }
+    InitializeBucketRange(begin, std::min(begin + chunk, level_end));
+    for (std::thread& thread : threads) thread.join();
+  }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+void LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::InitializeBucketRange(BucketIndex begin,
+                                                         BucketIndex end) {
+  auto& reclaimer = domain_.GetReclaimer();
+  for (BucketIndex bucket_index = begin; bucket_index < end; ++bucket_index) {
+    Guard guard(reclaimer);
+    HazardPointer head_hp;
+    if (nullptr == GetBucketHeadByIndex(bucket_index, head_hp)) {
+      InitializeBucket(bucket_index, head_hp);
+    }
+  }
+}
+
+// Only one Shrink runs at a time, it is the only one to remove dummy nodes:
+// each head of the upper half is taken out of its bucket before it is marked,
+// so a head loaded from a bucket and protected is never reclaimed. Its steps
+// run one at a time under shrink_busy_, in order, so an array or page is
+// released only after all of its buckets were emptied. Operations which
+// still use the old bucket size search from the parent of a bucket of the
+// upper half, see InitializeBucket, nothing waits for a step.
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+void LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::Shrink(size_t power) {
+  if (shrink_busy_.exchange(true, std::memory_order_acquire)) return;
+  if (power_of_2_.compare_exchange_strong(power, (power - 1) | kShrinking,
+                                          std::memory_order_seq_cst)) {
+    shrink_next_ = BucketIndex(1) << (power - 1);
+    EmptyNextBuckets();
+  }
+  shrink_busy_.store(false, std::memory_order_release);
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+void LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::ShrinkStep() {
+  if (shrink_busy_.load(std::memory_order_relaxed) ||
+      shrink_busy_.exchange(true, std::memory_order_acquire)) {
+    return;
+  }
+  // The step which held shrink_busy_ before may have ended the Shrink.
+  if (power_of_2_.load(std::memory_order_relaxed) & kShrinking) {
+    EmptyNextBuckets();
+  }
+  shrink_busy_.store(false, std::memory_order_release);
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+void LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::FinishShrink() {
+  if constexpr (Geometry::kShrinkable) {
+    Guard guard(domain_.GetReclaimer());
+    while (power_of_2_.load(std::memory_order_acquire) & kShrinking) {
+      ShrinkStep();
+      std::this_thread::yield();
+    }
+  }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+void LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::EmptyNextBuckets() {
+  auto& reclaimer = domain_.GetReclaimer();
+  const size_t power = power_of_2_.load(std::memory_order_relaxed) &
+                       ~kShrinking;
+  const BucketIndex first = BucketIndex(1) << power;
+  const BucketIndex end = first << 1;
+  const BucketIndex begin = shrink_next_;
+  const BucketIndex stop = std::min<BucketIndex>(begin + kShrinkStep, end);
+  for (BucketIndex bucket_index = begin; bucket_index < stop; ++bucket_index) {
+    HazardPointer bucket_hp;
+    Bucket* bucket = directory_.Get(bucket_index, &reclaimer, bucket_hp);
+    if (nullptr == bucket) continue;
+    DummyNode* head = bucket->exchange(nullptr, std::memory_order_acq_rel);
+    if (nullptr != head) DeleteDummyNode(head);
+  }
+  directory_.Shrink(first, begin, stop, reclaimer);
+  shrink_next_ = stop;
+  if (stop < end) return;
+
+  power_of_2_.store(power, std::memory_order_seq_cst);
+  // Grows which came meanwhile were dropped.
+  Grow(Geometry::TargetPowerOf2(size_.Load()));
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+void LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::DeleteDummyNode(DummyNode* head) {
+  // head may be reclaimed as soon as it is marked.
+  const Probe<K> probe(head);
+  BucketIndex parent_index = GetBucketParent(head->hash);
+  HazardPointer parent_hp;
+  Node* parent_head = GetBucketHeadByIndex(parent_index, parent_hp);
+  if (nullptr == parent_head) {
+    parent_head = InitializeBucket(parent_index, parent_hp);
   }
 
-  Bucket* buckets =
-      segments[(bucket_index / kSegmentSize) % kSegmentSize].get_sub_buckets();
-  if (nullptr == buckets) return nullptr;
+  // Logically delete head by marking head->next.
+  Node* next = head->get_next();
+  while (!head->next.compare_exchange_weak(next, get_marked_reference(next),
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+  }
 
-  Bucket& bucket = buckets[bucket_index % kSegmentSize];
-  return bucket.load(std::memory_order_consume);
+  // Searching from the parent bucket unlinks head on the way.
+  Node* prev;
+  Node* cur;
+  HazardPointer prev_hp, cur_hp;
+  SearchNode(&parent_head, parent_hp, probe, &prev, &cur, prev_hp, cur_hp);
 }
 
-template <typename K, typename V, typename Hash>
-bool LockFreeHashTable<K, V, Hash>::InsertDummyNode(DummyNode* parent_head,
-                                                    DummyNode* new_head,
-                                                    DummyNode** real_head) {
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+bool LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::
+    InsertDummyNode(Node* parent_head, HazardPointer& parent_hp,
+                    DummyNode* new_head, DummyNode** real_head,
+                    HazardPointer& real_head_hp) {
   Node* prev;
   Node* cur;
   HazardPointer prev_hp, cur_hp;
   do {
-    if (SearchNode(parent_head, new_head, &prev, &cur, prev_hp, cur_hp)) {
+    if (SearchNode(&parent_head, parent_hp, Probe<K>(new_head), &prev, &cur,
+                   prev_hp, cur_hp)) {
       // The head of bucket already insert into list.
       *real_head = static_cast<DummyNode*>(cur);
+      real_head_hp = std::move(cur_hp);
       return false;
     }
     new_head->next.store(cur, std::memory_order_release);
@@ -481,131 +2863,950 @@ bool LockFreeHashTable<K, V, Hash>::InsertDummyNode(DummyNode* parent_head,
 
 // Insert regular node into hash table, if its key is already exists in
 // hash table then update it and return false else return true.
-template <typename K, typename V, typename Hash>
-bool LockFreeHashTable<K, V, Hash>::InsertRegularNode(DummyNode* head,
-                                                      RegularNode* new_node) {
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+bool LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::InsertRegularNode(RegularNode* new_node,
+                                                     Finger* finger) {
+  auto& reclaimer = domain_.GetReclaimer();
+  Guard guard(reclaimer);
   Node* prev;
   Node* cur;
-  HazardPointer prev_hp, cur_hp;
-  auto& reclaimer = TableReclaimer<K, V>::GetInstance();
-  do {
-    if (SearchNode(head, new_node, &prev, &cur, prev_hp, cur_hp)) {
-      V* new_value = new_node->value.load(std::memory_order_consume);
-      V* old_value = static_cast<RegularNode*>(cur)->value.exchange(
-          new_value, std::memory_order_release);
-      reclaimer.ReclaimLater(old_value,
-                             [](void* ptr) { delete static_cast<V*>(ptr); });
-      new_node->value.store(nullptr, std::memory_order_release);
-      delete new_node;
-      return false;
+  HazardPointer head_hp, prev_hp, cur_hp, new_hp;
+  Probe<K> probe(new_node);
+  // Under Snapshots the version of new_node is stamped once it is linked,
+  // it may be deleted right after.
+  if constexpr (Snapshots) new_hp = HazardPointer(&reclaimer, new_node);
+  Node* head = GetSearchStart(probe, finger, head_hp);
+  while (true) {
+    if (SearchNode(&head, head_hp, probe, &prev, &cur, prev_hp, cur_hp)) {
+      Store stored =
+          StoreValue(static_cast<RegularNode*>(cur), reclaimer, new_node);
+      if (Store::kRemoved == stored) {
+        // The next search unlinks cur.
+        MarkNode(cur);
+        continue;
+      }
+      DeleteObject(new_node);
+      if (Store::kUpdated == stored) {
+        SetFinger(finger, head, head_hp, prev, prev_hp);
+        return false;
+      }
+      break;
     }
     new_node->next.store(cur, std::memory_order_release);
-  } while (!prev->next.compare_exchange_weak(
-      cur, new_node, std::memory_order_release, std::memory_order_relaxed));
-
-  size_t size = size_.fetch_add(1, std::memory_order_relaxed) + 1;
-  size_t power = power_of_2_.load(std::memory_order_relaxed);
-  if ((1 << power) * kLoadFactor < size) {
-    if (power_of_2_.compare_exchange_strong(power, power + 1,
-                                            std::memory_order_release)) {
-      assert(bucket_size() <=
-             kMaxBucketSize);  // Out of memory or you can change the kMaxLevel
-                               // and kSegmentSize.
+    if (prev->next.compare_exchange_weak(cur, new_node,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed)) {
+      if constexpr (Snapshots) StampValue(new_node, reclaimer);
+      break;
     }
+    Advance(&head, head_hp, prev, prev_hp);
   }
+  SetFinger(finger, head, head_hp, prev, prev_hp);
+
+  HelpShrink();
+  // The size only changes in batches, catch up with it when it does.
+  if (size_.Add(1)) Grow(Geometry::TargetPowerOf2(size_.Load()));
   return true;
 }
 
-template <typename K, typename V, typename Hash>
-bool LockFreeHashTable<K, V, Hash>::SearchNode(DummyNode* head,
-                                               Node* search_node,
-                                               Node** prev_ptr, Node** cur_ptr,
-                                               HazardPointer& prev_hp,
-                                               HazardPointer& cur_hp) {
-  auto& reclaimer = TableReclaimer<K, V>::GetInstance();
-try_again:
-  Node* prev = head;
-  Node* cur = prev->get_next();
-  Node* next;
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+size_t
+LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                  Snapshots>::InsertBatch(std::span<const std::pair<K, V>>
+                                              items) {
+  std::vector<RegularNode*> nodes;
+  nodes.reserve(items.size());
+  for (const std::pair<K, V>& item : items) {
+    nodes.push_back(
+        NewObject<RegularNode>(item.first, item.second, hash_func_));
+  }
+  // Bucket by bucket, each in list order. Equal keys keep their order, so
+  // that the last one wins.
+  const size_t sort_mask = bucket_size() - 1;
+  std::stable_sort(nodes.begin(), nodes.end(),
+                   [sort_mask](const RegularNode* a, const RegularNode* b) {
+                     if ((a->hash & sort_mask) != (b->hash & sort_mask)) {
+                       return (a->hash & sort_mask) < (b->hash & sort_mask);
+                     }
+                     if (a->reverse_hash != b->reverse_hash) {
+                       return a->reverse_hash < b->reverse_hash;
+                     }
+                     return a->hash < b->hash;
+                   });
+
+  auto& reclaimer = domain_.GetReclaimer();
+  Guard guard(reclaimer);
+  size_t inserted = 0;
+  // An item of the same bucket as the last one is searched from the node the
+  // last one went to if that is before it, as in GetSearchStart, from where
+  // the last search started if they share the hash, nodes of an equal hash
+  // are not in order of their keys. Others are searched from the head of
+  // their bucket, so are items which a Shrink since the sort put into one
+  // bucket out of list order.
+  Node* start = nullptr;
+  Node* last = nullptr;  // Only kept when the next item is in its bucket.
+  HazardPointer start_hp, last_hp, prev_hp, cur_hp;
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    RegularNode* new_node = nodes[i];
+    const size_t mask = bucket_size() - 1;
+    if (nullptr != last && last->reverse_hash < new_node->reverse_hash) {
+      start = last;
+      start_hp = std::move(last_hp);
+    } else if (nullptr == last || last->hash != new_node->hash) {
+      start = GetBucketHeadByHash(new_node->hash, start_hp);
+    }
+    bool keep_last = i + 1 < nodes.size() &&
+                     (nodes[i + 1]->hash & mask) == (new_node->hash & mask);
+    // Protect new_node before it is linked, it may be deleted right after.
+    if (keep_last || Snapshots) last_hp = HazardPointer(&reclaimer, new_node);
+
+    Node* prev;
+    Node* cur;
+    bool found = false;
+    Store stored;
+    while (true) {
+      if (SearchNode(&start, start_hp, Probe<K>(new_node), &prev, &cur,
+                     prev_hp, cur_hp)) {
+        stored =
+            StoreValue(static_cast<RegularNode*>(cur), reclaimer, new_node);
+        if (Store::kRemoved != stored) {
+          found = true;
+          break;
+        }
+        MarkNode(cur);
+        continue;
+      }
+      new_node->next.store(cur, std::memory_order_release);
+      if (prev->next.compare_exchange_weak(cur, new_node,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+        if constexpr (Snapshots) StampValue(new_node, reclaimer);
+        break;
+      }
+    }
+
+    if (found) {
+      DeleteObject(new_node);
+      last = keep_last ? cur : nullptr;
+      if (keep_last) last_hp = std::move(cur_hp);
+      if (Store::kUpdated == stored) continue;
+    } else {
+      last = keep_last ? new_node : nullptr;
+    }
+    ++inserted;
+    if (size_.Add(1)) Grow(Geometry::TargetPowerOf2(size_.Load()));
+  }
+  // Once for the batch, a step would drop the heads it searches from.
+  HelpShrink();
+  return inserted;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+size_t
+LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                  Snapshots>::FindBatch(std::span<const K> keys,
+                                        std::span<std::optional<V>> values) {
+  assert(keys.size() == values.size());
+  auto& reclaimer = domain_.GetReclaimer();
+  Guard guard(reclaimer);
+  size_t found = 0;
+  HashKey hashes[kFindBatchGroup];
+  typename Directory::template Cursor<HazardPointer> cursors[kFindBatchGroup];
+  Node* starts[kFindBatchGroup];
+  Node* prevs[kFindBatchGroup];
+  Node* curs[kFindBatchGroup];
+  Search searches[kFindBatchGroup];
+  // Every lookup of a group keeps its nodes protected until the group is
+  // done, they are reused by the next group.
+  HazardPointer start_hps[kFindBatchGroup], prev_hps[kFindBatchGroup],
+      cur_hps[kFindBatchGroup];
+  for (size_t begin = 0; begin < keys.size(); begin += kFindBatchGroup) {
+    const size_t n = std::min(kFindBatchGroup, keys.size() - begin);
+    const size_t mask = bucket_size() - 1;
+    for (size_t i = 0; i < n; ++i) {
+      hashes[i] = hash_func_(keys[begin + i]);
+    }
+    for (int level = 1; level <= Directory::kLevels; ++level) {
+      for (size_t i = 0; i < n; ++i) {
+        directory_.Prefetch(hashes[i] & mask, level, cursors[i],
+                            GetBucketReclaimer());
+      }
+    }
+    for (size_t i = 0; i < n; ++i) {
+      Bucket* bucket = directory_.Get(hashes[i] & mask, cursors[i]);
+      DummyNode* head =
+          nullptr == bucket ? nullptr : LoadBucketHead(*bucket, start_hps[i]);
+      if (nullptr == head) head = GetBucketHeadByHash(hashes[i], start_hps[i]);
+      starts[i] = head;
+      __builtin_prefetch(starts[i]);
+    }
+    for (size_t i = 0; i < n; ++i) {
+      prevs[i] = starts[i];
+      ResumeSearch(&starts[i], start_hps[i],
+                   Probe<K>(hashes[i], &keys[begin + i]), &prevs[i],
+                   &curs[i]);
+      // Prefetching does not fault, so it needs no protection yet.
+      __builtin_prefetch(curs[i]);
+      searches[i] = Search::kMore;
+    }
+    for (size_t pending = n; pending > 0;) {
+      for (size_t i = 0; i < n; ++i) {
+        if (Search::kMore != searches[i]) continue;
+        searches[i] = SearchStep(&starts[i], start_hps[i],
+                                 Probe<K>(hashes[i], &keys[begin + i]),
+                                 &prevs[i], &curs[i], prev_hps[i], cur_hps[i]);
+        if (Search::kMore == searches[i]) {
+          __builtin_prefetch(curs[i]);
+          continue;
+        }
+        --pending;
+        if constexpr (!kInlineValue) {
+          if (Search::kFound == searches[i]) {
+            __builtin_prefetch(static_cast<RegularNode*>(curs[i])->value.load(
+                std::memory_order_relaxed));
+          }
+        }
+      }
+    }
+    for (size_t i = 0; i < n; ++i) {
+      std::optional<V>& value = values[begin + i];
+      if (Search::kFound != searches[i] ||
+          !LoadValue(static_cast<RegularNode*>(curs[i]), reclaimer, value)) {
+        value.reset();
+        continue;
+      }
+      ++found;
+    }
+  }
+  return found;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+template <typename Q>
+bool LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::SearchNode(Node** start_ptr,
+                                              HazardPointer& start_hp,
+                                              const Probe<Q>& probe,
+                                              Node** prev_ptr, Node** cur_ptr,
+                                              HazardPointer& prev_hp,
+                                              HazardPointer& cur_hp) {
+  *prev_ptr = *start_ptr;
+  ResumeSearch(start_ptr, start_hp, probe, prev_ptr, cur_ptr);
+  Search search;
+  do {
+    search = SearchStep(start_ptr, start_hp, probe, prev_ptr, cur_ptr,
+                        prev_hp, cur_hp);
+  } while (Search::kMore == search);
+  return Search::kFound == search;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+template <typename Q>
+void LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::ResumeSearch(Node** start_ptr,
+                                                HazardPointer& start_hp,
+                                                const Probe<Q>& probe,
+                                                Node** prev_ptr,
+                                                Node** cur_ptr) {
+  // When another thread changes the list under prev, the search goes on from
+  // prev, which stays protected, as long as prev itself is not deleted.
   while (true) {
+    Node* prev = *prev_ptr;
+    Node* cur = prev->get_next();
+    if (!is_marked_reference(cur)) {
+      *cur_ptr = cur;
+      return;
+    }
+    if (prev == *start_ptr) {
+      // A head was removed by Shrink, the parent bucket covers its nodes.
+      // Bucket 0 is never removed. A deleted regular node is in no bucket any
+      // more.
+      BucketIndex bucket_index = prev->IsDummy()
+                                     ? GetBucketParent(prev->hash)
+                                     : probe.hash & (bucket_size() - 1);
+      DummyNode* head;
+      while (nullptr ==
+             (head = GetBucketHeadByIndex(bucket_index, start_hp))) {
+        bucket_index = GetBucketParent(bucket_index);
+      }
+      *start_ptr = head;
+    }
+    *prev_ptr = *start_ptr;
+  }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+template <typename Q>
+typename LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry,
+                           Reclamation, Snapshots>::Search
+LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                  Snapshots>::SearchStep(Node** start_ptr,
+                                         HazardPointer& start_hp,
+                                         const Probe<Q>& probe,
+                                         Node** prev_ptr, Node** cur_ptr,
+                                         HazardPointer& prev_hp,
+                                         HazardPointer& cur_hp) {
+  auto& reclaimer = domain_.GetReclaimer();
+  Node* prev = *prev_ptr;
+  Node* cur = *cur_ptr;
+  if constexpr (ThreadReclaimer::kHazardPointers) {
     cur_hp.UnMark();
     cur_hp = HazardPointer(&reclaimer, cur);
     // Make sure prev is the predecessor of cur,
     // so that cur is properly marked as hazard.
-    if (prev->get_next() != cur) goto try_again;
-
-    if (nullptr == cur) {
-      *prev_ptr = prev;
-      *cur_ptr = cur;
-      return false;
+    if (prev->get_next() != cur) {
+      ResumeSearch(start_ptr, start_hp, probe, prev_ptr, cur_ptr);
+      return Search::kMore;
     }
+  }
 
-    next = cur->get_next();
-    if (is_marked_reference(next)) {
-      if (!prev->next.compare_exchange_strong(cur,
-                                              get_unmarked_reference(next)))
-        goto try_again;
-
-      reclaimer.ReclaimLater(cur, LockFreeHashTable<K, V, Hash>::OnDeleteNode);
-      reclaimer.ReclaimNoHazardPointer();
-      size_.fetch_sub(1, std::memory_order_relaxed);
-      cur = get_unmarked_reference(next);
-    } else {
-      if (prev->get_next() != cur) goto try_again;
+  if (nullptr == cur) return Search::kMissing;
 
-      // Can not get copy_cur after above invocation,
-      // because prev may not be the predecessor of cur at this point.
-      if (GreaterOrEquals(cur, search_node)) {
-        *prev_ptr = prev;
-        *cur_ptr = cur;
-        return Equals(cur, search_node);
-      }
+  Node* next = cur->get_next();
+  if (is_marked_reference(next)) {
+    if (!prev->next.compare_exchange_strong(cur,
+                                            get_unmarked_reference(next))) {
+      ResumeSearch(start_ptr, start_hp, probe, prev_ptr, cur_ptr);
+      return Search::kMore;
+    }
 
-      // Swap cur_hp and prev_hp.
-      HazardPointer tmp = std::move(cur_hp);
-      cur_hp = std::move(prev_hp);
-      prev_hp = std::move(tmp);
+    // Under Snapshots the size drops when the tombstone is pushed.
+    if (!Snapshots && !cur->IsDummy()) size_.Add(-1);
+    reclaimer.ReclaimLater(cur, OnDeleteNode);
+    *cur_ptr = get_unmarked_reference(next);
+    return Search::kMore;
+  }
 
-      prev = cur;
-      cur = next;
+  if constexpr (ThreadReclaimer::kHazardPointers) {
+    if (prev->get_next() != cur) {
+      ResumeSearch(start_ptr, start_hp, probe, prev_ptr, cur_ptr);
+      return Search::kMore;
     }
-  };
+  }
+
+  // Can not get copy_cur after above invocation,
+  // because prev may not be the predecessor of cur at this point.
+  if (GreaterOrEquals(cur, probe)) {
+    return Equals(cur, probe) ? Search::kFound : Search::kMissing;
+  }
 
-  assert(false);
-  return false;
+  // Swap cur_hp and prev_hp.
+  HazardPointer tmp = std::move(cur_hp);
+  cur_hp = std::move(prev_hp);
+  prev_hp = std::move(tmp);
+
+  *prev_ptr = cur;
+  *cur_ptr = next;
+  return Search::kMore;
 }
 
-template <typename K, typename V, typename Hash>
-bool LockFreeHashTable<K, V, Hash>::DeleteNode(DummyNode* head,
-                                               Node* delete_node) {
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+template <typename Q>
+bool LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::DeleteNode(const Probe<Q>& probe,
+                                              Finger* finger) {
+  auto& reclaimer = domain_.GetReclaimer();
+  Guard guard(reclaimer);
   Node* prev;
   Node* cur;
   Node* next;
-  HazardPointer prev_hp, cur_hp;
-  do {
-    do {
-      if (!SearchNode(head, delete_node, &prev, &cur, prev_hp, cur_hp)) {
+  HazardPointer head_hp, prev_hp, cur_hp;
+  Node* head = GetSearchStart(probe, finger, head_hp);
+  bool unlink = true;
+  while (true) {
+    if (!SearchNode(&head, head_hp, probe, &prev, &cur, prev_hp, cur_hp)) {
+      SetFinger(finger, head, head_hp, prev, prev_hp);
+      return false;
+    }
+    if constexpr (Snapshots) {
+      if (!EraseValue(static_cast<RegularNode*>(cur), reclaimer, &unlink)) {
+        SetFinger(finger, head, head_hp, prev, prev_hp);
         return false;
       }
-      next = cur->get_next();
-    } while (is_marked_reference(next));
+      // Marked by EraseValue when unlink is set.
+      next = get_unmarked_reference(cur->get_next());
+      break;
+    }
+    next = cur->get_next();
     // Logically delete cur by marking cur->next.
-  } while (!cur->next.compare_exchange_weak(next, get_marked_reference(next),
-                                            std::memory_order_release,
-                                            std::memory_order_relaxed));
+    if (!is_marked_reference(next) &&
+        cur->next.compare_exchange_weak(next, get_marked_reference(next),
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+      break;
+    }
+    Advance(&head, head_hp, prev, prev_hp);
+  }
 
-  if (prev->next.compare_exchange_strong(cur, next,
-                                         std::memory_order_release)) {
-    size_.fetch_sub(1, std::memory_order_relaxed);
-    auto& reclaimer = TableReclaimer<K, V>::GetInstance();
-    reclaimer.ReclaimLater(cur, LockFreeHashTable<K, V, Hash>::OnDeleteNode);
-    reclaimer.ReclaimNoHazardPointer();
+  if (!unlink) {
+    // A tombstone stays for the snapshots which see the value.
+  } else if (prev->next.compare_exchange_strong(cur, next,
+                                                std::memory_order_release)) {
+    if constexpr (!Snapshots) size_.Add(-1);
+    reclaimer.ReclaimLater(cur, OnDeleteNode);
   } else {
     prev_hp.UnMark();
     cur_hp.UnMark();
-    SearchNode(head, delete_node, &prev, &cur, prev_hp, cur_hp);
+    SearchNode(&head, head_hp, probe, &prev, &cur, prev_hp, cur_hp);
+  }
+  SetFinger(finger, head, head_hp, prev, prev_hp);
+
+  if constexpr (Geometry::kShrinkable) {
+    size_t power = power_of_2_.load(std::memory_order_relaxed);
+    if (power & kShrinking) {
+      ShrinkStep();
+    } else if (Geometry::ShouldShrink(power, size_.Load())) {
+      Shrink(power);
+    }
+  }
+  return true;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+typename LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry,
+                           Reclamation, Snapshots>::Node*
+LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                  Snapshots>::NextNode(Walk& walk) {
+  auto& reclaimer = domain_.GetReclaimer();
+  while (true) {
+    Node* cur = walk.prev->get_next();
+    if (is_marked_reference(cur)) {
+      // prev is deleted, start over from the head of a bucket before it.
+      BucketIndex bucket_index = walk.prev->hash & (bucket_size() - 1);
+      DummyNode* head;
+      while (nullptr ==
+             (head = GetBucketHeadByIndex(bucket_index, walk.head_hp))) {
+        bucket_index = GetBucketParent(bucket_index);
+      }
+      walk.prev = head;
+      walk.started_over = true;
+      walk.to_skip = walk.last_count;
+      continue;
+    }
+
+    if constexpr (ThreadReclaimer::kHazardPointers) {
+      walk.cur_hp.UnMark();
+      walk.cur_hp = HazardPointer(&reclaimer, cur);
+      if (walk.prev->get_next() != cur) continue;
+    }
+    if (nullptr == cur) return nullptr;
+
+    Node* next = cur->get_next();
+    if (is_marked_reference(next)) {
+      if (walk.prev->next.compare_exchange_strong(
+              cur, get_unmarked_reference(next))) {
+        if (!Snapshots && !cur->IsDummy()) size_.Add(-1);
+        reclaimer.ReclaimLater(cur, OnDeleteNode);
+      }
+      continue;
+    }
+
+    bool at_last = cur->reverse_hash == walk.last_reverse_hash &&
+                   cur->hash == walk.last_hash;
+    if (walk.started_over) {
+      if (cur->reverse_hash < walk.last_reverse_hash ||
+          (cur->reverse_hash == walk.last_reverse_hash &&
+           cur->hash < walk.last_hash)) {
+        // Visited before starting over.
+      } else if (at_last && walk.to_skip > 0) {
+        --walk.to_skip;
+      } else {
+        walk.started_over = false;
+      }
+    }
+
+    // Swap cur_hp and prev_hp.
+    HazardPointer tmp = std::move(walk.cur_hp);
+    walk.cur_hp = std::move(walk.prev_hp);
+    walk.prev_hp = std::move(tmp);
+    walk.prev = cur;
+
+    if (!walk.started_over) {
+      if (at_last) {
+        ++walk.last_count;
+      } else {
+        walk.last_reverse_hash = cur->reverse_hash;
+        walk.last_hash = cur->hash;
+        walk.last_count = 1;
+      }
+      return cur;
+    }
+  }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+typename LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry,
+                           Reclamation, Snapshots>::Store
+LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                  Snapshots>::StoreValue(RegularNode* node,
+                                         ThreadReclaimer& reclaimer,
+                                         RegularNode* other) {
+  if constexpr (!Snapshots) {
+    node->StoreValue(reclaimer, other);
+    return Store::kUpdated;
+  } else {
+    Version* version = other->value.load(std::memory_order_relaxed);
+    // Protect version before it is published, it may be trimmed right after.
+    HazardPointer version_hp(&reclaimer, version);
+    HazardPointer head_hp;
+    Version* head;
+    while (true) {
+      head = LoadVersion(node, reclaimer, head_hp);
+      if (Removed() == head) {
+        version->prev.store(nullptr, std::memory_order_relaxed);
+        return Store::kRemoved;
+      }
+      // The version it replaces takes effect first.
+      Stamp(head);
+      version->prev.store(head, std::memory_order_relaxed);
+      if (node->value.compare_exchange_strong(head, version,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed)) {
+        break;
+      }
+    }
+    other->value.store(nullptr, std::memory_order_relaxed);
+    Stamp(version);
+    if (Trim(version, OldestSnapshot(), reclaimer)) {
+      retained_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return head->value ? Store::kUpdated : Store::kRevived;
+  }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+bool LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::EraseValue(RegularNode* node,
+                                              ThreadReclaimer& reclaimer,
+                                              bool* unlink) {
+  Version* tombstone = nullptr;
+  HazardPointer head_hp, tombstone_hp;
+  while (true) {
+    Version* head = LoadVersion(node, reclaimer, head_hp);
+    if (Removed() == head || !head->value) {
+      if (nullptr != tombstone) DeleteObject(tombstone);
+      return false;
+    }
+    if (nullptr == tombstone) {
+      tombstone = NewObject<Version>();
+      tombstone_hp = HazardPointer(&reclaimer, tombstone);
+    }
+    Stamp(head);
+    tombstone->prev.store(head, std::memory_order_relaxed);
+    if (node->value.compare_exchange_strong(head, tombstone,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+      break;
+    }
+  }
+  Stamp(tombstone);
+  size_.Add(-1);
+  *unlink = TryRemove(node, tombstone, OldestSnapshot(), reclaimer);
+  if (*unlink) MarkNode(node);
+  return true;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+bool LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::TryRemove(RegularNode* node,
+                                             Version* tombstone,
+                                             uint64_t oldest,
+                                             ThreadReclaimer& reclaimer) {
+  if (Stamp(tombstone) > oldest) {
+    // A snapshot may still see the value before it.
+    if (Trim(tombstone, oldest, reclaimer)) {
+      retained_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return false;
+  }
+  // Fails when an insert revived the item meanwhile.
+  Version* expected = tombstone;
+  if (!node->value.compare_exchange_strong(expected, Removed(),
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_relaxed)) {
+    return false;
+  }
+  RetireVersions(tombstone, reclaimer);
+  return true;
+}
+
+// Versions are stamped in the order they are pushed, so the stamps fall
+// towards the end of the chain. A snapshot of oldest or later reads the
+// first version stamped up to oldest or one before it.
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+bool LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::Trim(Version* version, uint64_t oldest,
+                                        ThreadReclaimer& reclaimer) {
+  Version* cur = version;
+  HazardPointer cur_hp, prev_hp;
+  while (cur->version.load(std::memory_order_acquire) > oldest) {
+    Version* prev = cur->prev.load(std::memory_order_acquire);
+    // Trimmed or retired concurrently.
+    if (nullptr == prev) return cur != version;
+    prev_hp = HazardPointer(&reclaimer, prev);
+    if (prev != cur->prev.load(std::memory_order_acquire)) continue;
+    cur = prev;
+    std::swap(cur_hp, prev_hp);
+  }
+  RetireVersions(cur->prev.exchange(nullptr, std::memory_order_acq_rel),
+                 reclaimer);
+  return cur != version;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+template <typename F>
+bool LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::VisitVersion(RegularNode* node,
+                                                uint64_t version,
+                                                ThreadReclaimer& reclaimer,
+                                                F&& fn) {
+  HazardPointer cur_hp, prev_hp;
+  Version* cur = LoadVersion(node, reclaimer, cur_hp);
+  // Removed once no snapshot sees a value of it.
+  if (Removed() == cur) return false;
+  while (Stamp(cur) > version) {
+    Version* prev = cur->prev.load(std::memory_order_acquire);
+    // Inserted after the snapshot.
+    if (nullptr == prev) return false;
+    prev_hp = HazardPointer(&reclaimer, prev);
+    if (prev != cur->prev.load(std::memory_order_acquire)) continue;
+    cur = prev;
+    std::swap(cur_hp, prev_hp);
+  }
+  if (!cur->value) return false;
+  fn(*cur->value);
+  return true;
+}
+
+// A snapshot announces the clock before it takes its version from it, so
+// that a write which reads the announcements in between keeps what the
+// snapshot reads, see OldestSnapshot. Records are reused, never freed
+// before the table.
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+typename LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry,
+                           Reclamation, Snapshots>::SnapshotRecord*
+LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                  Snapshots>::AcquireSnapshot(uint64_t* version) {
+  SnapshotRecord* record = snapshot_records_.load(std::memory_order_acquire);
+  for (; record != nullptr; record = record->next) {
+    bool in_use = false;
+    if (!record->in_use.load(std::memory_order_relaxed) &&
+        record->in_use.compare_exchange_strong(in_use, true,
+                                               std::memory_order_acquire)) {
+      break;
+    }
+  }
+  if (nullptr == record) {
+    record = NewObject<SnapshotRecord>();
+    SnapshotRecord* head = snapshot_records_.load(std::memory_order_relaxed);
+    do {
+      record->next = head;
+    } while (!snapshot_records_.compare_exchange_weak(
+        head, record, std::memory_order_release, std::memory_order_relaxed));
+  }
+  record->version.store(clock_.load(std::memory_order_seq_cst),
+                        std::memory_order_seq_cst);
+  *version = clock_.fetch_add(1, std::memory_order_seq_cst);
+  record->version.store(*version, std::memory_order_seq_cst);
+  return record;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+void LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::ReleaseSnapshot(SnapshotRecord* record) {
+  record->version.store(0, std::memory_order_seq_cst);
+  record->in_use.store(false, std::memory_order_release);
+  Sweep();
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+void LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::Sweep() {
+  if (0 == retained_.exchange(0, std::memory_order_acq_rel)) return;
+  auto& reclaimer = domain_.GetReclaimer();
+  const uint64_t oldest = OldestSnapshot();
+  ForEachNode([&](Node* node) {
+    if (node->IsDummy()) return;
+    RegularNode* regular = static_cast<RegularNode*>(node);
+    HazardPointer head_hp;
+    Version* head = LoadVersion(regular, reclaimer, head_hp);
+    if (Removed() == head) return;
+    // Trim only cuts below stamped versions.
+    Stamp(head);
+    if (!head->value) {
+      // Unlinked by the walk or a later search.
+      if (TryRemove(regular, head, oldest, reclaimer)) MarkNode(regular);
+    } else if (Trim(head, oldest, reclaimer)) {
+      retained_.fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+template <typename Serializer>
+bool LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::SaveTo(int fd,
+                                          const Serializer& serializer) {
+  FileWriter out(fd);
+  const uint64_t count = size_exact();
+  bool ok = out.Write(&kFileMagic, sizeof(kFileMagic)) &&
+            out.Write(&kFileFormat, sizeof(kFileFormat)) &&
+            out.Write(&count, sizeof(count));
+  auto& reclaimer = domain_.GetReclaimer();
+  const uint8_t kItem = 1, kEnd = 0;
+  uint64_t saved = 0;
+  ForEachNode([&](Node* node) {
+    if (!ok || node->IsDummy()) return;
+    RegularNode* regular = static_cast<RegularNode*>(node);
+    VisitValue(regular, reclaimer, [&](const V& value) {
+      ok = out.Write(&kItem, sizeof(kItem)) &&
+           serializer.Save(out, regular->key) && serializer.Save(out, value);
+      if (ok) ++saved;
+    });
+  });
+  return ok && out.Write(&kEnd, sizeof(kEnd)) &&
+         out.Write(&saved, sizeof(saved)) && out.Flush() && saved == count;
+}
+
+// In list order the heads of 2^power buckets are those of bucket
+// Reverse(i << (64 - power)) for i from 0, whose dummy key is i << (64 -
+// power), so they are merged with the items by a counter.
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+template <typename Serializer>
+bool LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::LoadFrom(int fd,
+                                            const Serializer& serializer) {
+  FileReader in(fd);
+  uint32_t magic, format;
+  uint64_t count;
+  if (!in.Read(&magic, sizeof(magic)) || !in.Read(&format, sizeof(format)) ||
+      !in.Read(&count, sizeof(count)) || kFileMagic != magic ||
+      kFileFormat != format) {
+    return false;
+  }
+  // An item takes at least its tag byte and the smallest key and value.
+  const uint64_t item_size = 1 + MinSavedSize<Serializer, K>() +
+                             MinSavedSize<Serializer, V>();
+  uint64_t hint = std::min(count, kMaxLoadHint);
+  struct stat st;
+  if (0 == fstat(fd, &st) && S_ISREG(st.st_mode)) {
+    hint = std::min<uint64_t>(count, st.st_size / item_size);
+  }
+  FinishShrink();
+  Grow(Geometry::TargetPowerOf2(size_exact() + hint));
+  const BucketIndex buckets = bucket_size();
+  const int shift = 64 - __builtin_ctzl(buckets);
+
+  auto& reclaimer = domain_.GetReclaimer();
+  Guard guard(reclaimer);
+  Node* prev = head_;
+  BucketIndex next_head = 1;  // head_ is the first.
+  auto append_heads = [&](HashKey end) {
+    for (; next_head < buckets && (next_head << shift) < end; ++next_head) {
+      BucketIndex bucket_index = Node::Reverse(next_head << shift);
+      HazardPointer head_hp;
+      if (nullptr != GetBucketHeadByIndex(bucket_index, head_hp)) continue;
+      DummyNode* head = NewObject<DummyNode>(bucket_index);
+      if (!AppendNode(head, &prev)) {
+        DeleteObject(head);
+        continue;
+      }
+      HazardPointer bucket_hp;
+      directory_.GetOrCreate(bucket_index, GetBucketReclaimer(), bucket_hp)
+          .store(head, std::memory_order_release);
+    }
+  };
+
+  int64_t appended = 0;
+  uint64_t loaded = 0;
+  uint8_t tag = 1;  // Stays 1 when the file ends early.
+  while (in.Read(&tag, sizeof(tag)) && 1 == tag) {
+    std::optional<K> key = serializer.template Load<K>(in);
+    if (!key) break;
+    std::optional<V> value = serializer.template Load<V>(in);
+    if (!value) break;
+    RegularNode* node = NewObject<RegularNode>(std::move(*key),
+                                               std::move(*value), hash_func_);
+    ++loaded;
+    append_heads(node->reverse_hash);
+    if (AppendNode(node, &prev)) {
+      if constexpr (Snapshots) StampValue(node, reclaimer);
+      ++appended;
+    } else {
+      InsertRegularNode(node);
+    }
   }
+  append_heads(~HashKey(0));
+  if (appended > 0 && size_.Add(appended)) {
+    Grow(Geometry::TargetPowerOf2(size_.Load()));
+  }
+
+  uint64_t saved;
+  return 0 == tag && in.Read(&saved, sizeof(saved)) && saved == loaded &&
+         saved == count;
+}
 
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+bool LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::AppendNode(Node* node, Node** prev) {
+  auto before = [](const Node* a, const Node* b) {
+    return a->reverse_hash < b->reverse_hash ||
+           (a->reverse_hash == b->reverse_hash && a->hash < b->hash);
+  };
+  if (!before(*prev, node)) return false;
+  Node* cur = (*prev)->next.load(std::memory_order_relaxed);
+  while (nullptr != cur && before(cur, node)) {
+    Node* next = cur->next.load(std::memory_order_relaxed);
+    if (is_marked_reference(next)) {
+      // A deleted node which was not unlinked yet.
+      next = get_unmarked_reference(next);
+      (*prev)->next.store(next, std::memory_order_release);
+      if (!Snapshots && !cur->IsDummy()) size_.Add(-1);
+      domain_.GetReclaimer().ReclaimLater(cur, OnDeleteNode);
+    } else {
+      *prev = cur;
+    }
+    cur = next;
+  }
+  if (nullptr != cur && !before(node, cur)) return false;
+  node->next.store(cur, std::memory_order_relaxed);
+  (*prev)->next.store(node, std::memory_order_release);
+  *prev = node;
   return true;
 }
+
+// A part is a bucket of a table of at least kPartitionsPerThread buckets
+// per thread, as far as the bucket size allows, so that threads which finish
+// early take over more parts.
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+template <typename F>
+void LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::ParallelForEach(int n_threads, F&& fn) {
+  static const size_t kPartitionsPerThread = 16;
+  n_threads = std::max(n_threads, 1);
+  size_t wanted = kPartitionsPerThread * n_threads;
+  size_t partitions =
+      std::min(bucket_size(), size_t(1) << (64 - __builtin_clzl(wanted - 1)));
+  std::atomic<size_t> next_partition(0);
+  auto scan = [&] {
+    auto& reclaimer = domain_.GetReclaimer();
+    for (size_t i = next_partition.fetch_add(1, std::memory_order_relaxed);
+         i < partitions;
+         i = next_partition.fetch_add(1, std::memory_order_relaxed)) {
+      ForEachNodeInBucket(i, partitions, [&](Node* node) {
+        if (node->IsDummy()) return;
+        RegularNode* regular = static_cast<RegularNode*>(node);
+        VisitValue(regular, reclaimer,
+                   [&](const V& value) { fn(regular->key, value); });
+      });
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < n_threads; ++i) threads.emplace_back(scan);
+  scan();
+  for (std::thread& thread : threads) thread.join();
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+template <typename F>
+void LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                       Snapshots>::ForEachNodeInBucket(BucketIndex bucket_index,
+                                                       size_t partitions,
+                                                       F&& fn) {
+  Guard guard(domain_.GetReclaimer());
+  HazardPointer head_hp;
+  DummyNode* head = GetBucketHeadByIndex(bucket_index, head_hp);
+  if (nullptr == head) head = InitializeBucket(bucket_index, head_hp);
+  Walk walk(head);
+  walk.head_hp = std::move(head_hp);
+  fn(walk.prev);
+  const BucketIndex mask = partitions - 1;
+  const HashKey start = Node::DummyKey(bucket_index);
+  while (Node* node = NextNode(walk)) {
+    // A Shrink dropped the bucket and head is its parent's, whose nodes come
+    // first.
+    if (node->reverse_hash < start) continue;
+    // The first node of the next bucket in list order.
+    if ((node->hash & mask) != bucket_index) return;
+    fn(node);
+  }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual,
+          typename Allocator, typename Geometry, typename Reclamation,
+          bool Snapshots>
+typename LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry,
+                           Reclamation, Snapshots>::Stats
+LockFreeHashTable<K, V, Hash, KeyEqual, Allocator, Geometry, Reclamation,
+                  Snapshots>::GetStats() {
+  Stats stats = {};
+  stats.bucket_size = bucket_size();
+  BucketIndex mask = stats.bucket_size - 1;
+  BucketIndex chain_bucket = 0;
+  size_t chain = 0;
+  size_t chains = 0;
+  ForEachNode([&](Node* node) {
+    if (node->IsDummy()) {
+      ++stats.dummy_nodes;
+      return;
+    }
+    ++stats.size;
+    // Items of a bucket are adjacent in split order.
+    BucketIndex bucket_index = node->hash & mask;
+    if (0 == chain || bucket_index != chain_bucket) {
+      chain_bucket = bucket_index;
+      chain = 0;
+      ++chains;
+    }
+    stats.max_chain = std::max(stats.max_chain, ++chain);
+  });
+  stats.load_factor = static_cast<double>(stats.size) / stats.bucket_size;
+  if (chains > 0) {
+    stats.average_chain = static_cast<double>(stats.size) / chains;
+  }
+  return stats;
+}
 #endif  // LOCKFREE_HASHTABLE_H
@@ -1,7 +1,13 @@
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <random>
+#include <span>
+#include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
 #include <vector>
@@ -58,7 +64,7 @@ void onDelete(int divide) {
 }
 
 void TestConcurrentInsert() {
-  int old_size = ht.size();
+  int old_size = ht.size_exact();
   std::vector<std::thread> threads;
   for (int i = 0; i < kMaxThreads; ++i) {
     threads.push_back(std::thread(onInsert, kMaxThreads));
@@ -71,7 +77,7 @@ void TestConcurrentInsert() {
   }
   auto t2_ = std::chrono::steady_clock::now();
 
-  assert(cnt + old_size == static_cast<int>(ht.size()));
+  assert(cnt + old_size == static_cast<int>(ht.size_exact()));
   int ms =
       std::chrono::duration_cast<std::chrono::milliseconds>(t2_ - t1_).count();
   elements2timespan[maxElements][0] += ms;
@@ -105,7 +111,7 @@ void TestConcurrentFind() {
 }
 
 void TestConcurrentDelete() {
-  int old_size = ht.size();
+  int old_size = ht.size_exact();
   std::vector<std::thread> threads;
   for (int i = 0; i < kMaxThreads; ++i) {
     threads.push_back(std::thread(onDelete, kMaxThreads));
@@ -119,7 +125,7 @@ void TestConcurrentDelete() {
   }
   auto t2_ = std::chrono::steady_clock::now();
 
-  assert(cnt + old_size == static_cast<int>(ht.size()));
+  assert(cnt + old_size == static_cast<int>(ht.size_exact()));
   int ms =
       std::chrono::duration_cast<std::chrono::milliseconds>(t2_ - t1_).count();
   elements2timespan[maxElements][2] += ms;
@@ -132,7 +138,7 @@ void TestConcurrentDelete() {
 }
 
 void TestConcurrentInsertAndFindAndDequeue() {
-  int old_size = ht.size();
+  int old_size = ht.size_exact();
 
   int divide = kMaxThreads / 3;
   std::vector<std::thread> threads;
@@ -150,7 +156,7 @@ void TestConcurrentInsertAndFindAndDequeue() {
   }
   auto t2_ = std::chrono::steady_clock::now();
 
-  assert(cnt + old_size == static_cast<int>(ht.size()));
+  assert(cnt + old_size == static_cast<int>(ht.size_exact()));
   int ms =
       std::chrono::duration_cast<std::chrono::milliseconds>(t2_ - t1_).count();
   elements2timespan[maxElements][3] += ms;
@@ -167,12 +173,2116 @@ const int kElements1 = 10000;
 const int kElements2 = 100000;
 const int kElements3 = 1000000;
 
-int main(int argc, char const* argv[]) {
-  (void)argc;
-  (void)argv;
+// Gives the microbenchmarks below access to the internals of
+// LockFreeHashTable.
+class LockFreeHashTableTest {
+ public:
+  template <typename Table>
+  static size_t DummyNodeSize() {
+    return sizeof(typename Table::DummyNode);
+  }
+
+  template <typename Table>
+  static size_t RegularNodeSize() {
+    return sizeof(typename Table::RegularNode);
+  }
+
+  template <typename Table>
+  static size_t Reverse(size_t hash) {
+    return Table::Node::Reverse(hash);
+  }
+
+  template <typename Table>
+  static size_t BucketSize(const Table& table) {
+    return table.bucket_size();
+  }
+
+  template <typename Table>
+  static void* GetBucketHead(Table& table, size_t bucket_index) {
+    typename Table::HazardPointer head_hp;
+    return table.GetBucketHeadByIndex(bucket_index, head_hp);
+  }
+};
+
+// Lookup Table that store the reverse of each 8bit number, the reference
+// implementation of reversing bits.
+#define R2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define R4(n) R2(n), R2(n + 2 * 16), R2(n + 1 * 16), R2(n + 3 * 16)
+#define R6(n) R4(n), R4(n + 2 * 4), R4(n + 1 * 4), R4(n + 3 * 4)
+const size_t kReverse8Bits[256] = {R6(0), R6(2), R6(1), R6(3)};
+
+size_t ReverseByLookupTable(size_t hash) {
+  return kReverse8Bits[hash & 0xff] << 56 |
+         kReverse8Bits[(hash >> 8) & 0xff] << 48 |
+         kReverse8Bits[(hash >> 16) & 0xff] << 40 |
+         kReverse8Bits[(hash >> 24) & 0xff] << 32 |
+         kReverse8Bits[(hash >> 32) & 0xff] << 24 |
+         kReverse8Bits[(hash >> 40) & 0xff] << 16 |
+         kReverse8Bits[(hash >> 48) & 0xff] << 8 |
+         kReverse8Bits[(hash >> 56) & 0xff];
+}
+
+// The split-order key computation agrees with the lookup table.
+void TestReverse() {
+  typedef LockFreeHashTable<int, int> Table;
+  std::mt19937_64 gen(0);
+  for (int i = 0; i < 64; ++i) {
+    size_t hash = static_cast<size_t>(1) << i;
+    assert(LockFreeHashTableTest::Reverse<Table>(hash) ==
+           ReverseByLookupTable(hash));
+    assert(LockFreeHashTableTest::Reverse<Table>(hash - 1) ==
+           ReverseByLookupTable(hash - 1));
+  }
+  for (int i = 0; i < kElements3; ++i) {
+    size_t hash = gen();
+    assert(LockFreeHashTableTest::Reverse<Table>(hash) ==
+           ReverseByLookupTable(hash));
+  }
+}
+
+// Measure the split-order key computation against the lookup table.
+void BenchmarkReverse() {
+  typedef LockFreeHashTable<int, int> Table;
+  const int n = 100 * kElements3;
+  volatile size_t sink = 0;
+  auto t1_ = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < static_cast<size_t>(n); ++i) {
+    sink = sink + ReverseByLookupTable(i * 0x9e3779b97f4a7c15);
+  }
+  auto t2_ = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < static_cast<size_t>(n); ++i) {
+    sink = sink + LockFreeHashTableTest::Reverse<Table>(i * 0x9e3779b97f4a7c15);
+  }
+  auto t3_ = std::chrono::steady_clock::now();
+  std::cout << n << " reverses by lookup table, timespan="
+            << std::chrono::duration<double, std::milli>(t2_ - t1_).count()
+            << "ms"
+            << "\n";
+  std::cout << n << " reverses by Node::Reverse, timespan="
+            << std::chrono::duration<double, std::milli>(t3_ - t2_).count()
+            << "ms"
+            << "\n";
+}
+
+// Measure resolving bucket indexes to their heads through the directory of
+// the given geometry, in order and in random order.
+template <typename Geometry>
+void ResolveBuckets(const char* name) {
+  typedef LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                            DefaultAllocator, Geometry>
+      Table;
+  Table table;
+  for (int i = 0; i < kElements3; ++i) {
+    table.Insert(i, i);
+  }
+
+  const size_t mask = LockFreeHashTableTest::BucketSize(table) - 1;
+  const size_t n = 100 * kElements3;
+  for (int round = 0; round < 3; ++round) {
+    size_t found = 0;
+    auto t1_ = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) {
+      found += LockFreeHashTableTest::GetBucketHead(table, i & mask) != nullptr;
+    }
+    auto t2_ = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) {
+      found += LockFreeHashTableTest::GetBucketHead(
+                   table, (i * 0x9e3779b97f4a7c15) & mask) != nullptr;
+    }
+    auto t3_ = std::chrono::steady_clock::now();
+    std::cout << name << ", " << n << " sequential bucket lookups, timespan="
+              << std::chrono::duration<double, std::milli>(t2_ - t1_).count()
+              << "ms"
+              << "\n";
+    std::cout << name << ", " << n << " random bucket lookups, timespan="
+              << std::chrono::duration<double, std::milli>(t3_ - t2_).count()
+              << "ms, " << found << " heads found"
+              << "\n";
+  }
+}
+
+void BenchmarkBucket() {
+  ResolveBuckets<DefaultGeometry>("segment directory");
+  ResolveBuckets<FlatGeometry<24>>("flat directory");
+}
+
+// Run fn(thread_index) on n_threads threads and return the elapsed time in
+// milliseconds.
+template <typename F>
+double RunConcurrently(int n_threads, F fn) {
+  std::vector<std::thread> threads;
+  for (int i = 0; i < n_threads; ++i) {
+    threads.push_back(std::thread([&fn, i] {
+      while (!start) {
+        std::this_thread::yield();
+      }
+      fn(i);
+    }));
+  }
+
+  start = true;
+  auto t1_ = std::chrono::steady_clock::now();
+  for (int i = 0; i < n_threads; ++i) {
+    threads[i].join();
+  }
+  auto t2_ = std::chrono::steady_clock::now();
+  start = false;
+  return std::chrono::duration<double, std::milli>(t2_ - t1_).count();
+}
+
+// Print node sizes and concurrent Find throughput on a filled table.
+void BenchmarkNode() {
+  typedef LockFreeHashTable<int, int> Table;
+  std::cout << "sizeof(DummyNode)="
+            << LockFreeHashTableTest::DummyNodeSize<Table>()
+            << ", sizeof(RegularNode)="
+            << LockFreeHashTableTest::RegularNodeSize<Table>() << "\n";
+
+  const int n = kElements3;
+  Table table;
+  for (int i = 0; i < n; ++i) {
+    table.Insert(i, i);
+  }
+
+  const int finds = 10 * n;
+  for (int round = 0; round < 3; ++round) {
+    double ms = RunConcurrently(kMaxThreads, [&](int i) {
+      std::mt19937 gen(i);
+      int value;
+      for (int j = 0; j < finds / kMaxThreads; ++j) {
+        table.Find(gen() % n, value);
+      }
+    });
+    std::cout << finds << " finds in " << n << " elements, timespan=" << ms
+              << "ms, " << finds / ms / 1000 << " Mops/s"
+              << "\n";
+  }
+}
+
+// Insert and delete disjoint key ranges from every thread so that nodes are
+// constantly allocated and reclaimed. Threads quiesce after every pass.
+template <typename Table>
+double ChurnTable(int rounds) {
+  Table table;
+  const int n = kElements2;
+  return RunConcurrently(kMaxThreads, [&](int i) {
+    table.RegisterThread();
+    for (int round = 0; round < rounds; ++round) {
+      for (int j = i; j < n; j += kMaxThreads) {
+        table.Insert(j, j);
+      }
+      table.Quiesce();
+      for (int j = i; j < n; j += kMaxThreads) {
+        table.Delete(j);
+      }
+      table.Quiesce();
+    }
+    table.UnregisterThread();
+  });
+}
+
+// Compare insert/delete churn with the default and the slab allocator.
+void BenchmarkAllocator() {
+  typedef LockFreeHashTable<int, int> DefaultTable;
+  typedef LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                            SlabAllocator>
+      SlabTable;
+  for (int round = 0; round < 3; ++round) {
+    std::cout << "default allocator, timespan=" << ChurnTable<DefaultTable>(10)
+              << "ms"
+              << "\n";
+    std::cout << "slab allocator, timespan=" << ChurnTable<SlabTable>(10)
+              << "ms"
+              << "\n";
+  }
+}
+
+// Measure concurrent Find and Insert/Delete churn on a table of the given
+// reclamation policy.
+template <typename Reclamation>
+void MeasureReclamation(const char* name) {
+  typedef LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                            DefaultAllocator, DefaultGeometry, Reclamation>
+      Table;
+  const int n = kElements3;
+  Table table;
+  for (int i = 0; i < n; ++i) {
+    table.Insert(i, i);
+  }
+
+  const int finds = 10 * n;
+  double ms = RunConcurrently(kMaxThreads, [&](int i) {
+    std::mt19937 gen(i);
+    int value;
+    table.RegisterThread();
+    for (int j = 0; j < finds / kMaxThreads; ++j) {
+      table.Find(gen() % n, value);
+      if (j % 1024 == 0) table.Quiesce();
+    }
+    table.UnregisterThread();
+  });
+  std::cout << name << ", " << finds << " finds in " << n
+            << " elements, timespan=" << ms << "ms, " << finds / ms / 1000
+            << " Mops/s"
+            << "\n";
+  std::cout << name << ", churn timespan=" << ChurnTable<Table>(10) << "ms"
+            << "\n";
+}
+
+// Compare hazard pointers with epoch and quiescent state based reclamation.
+void BenchmarkReclamation() {
+  for (int round = 0; round < 3; ++round) {
+    MeasureReclamation<HazardPointerReclamation>("hazard pointers");
+    MeasureReclamation<EpochReclamation>("epochs");
+    MeasureReclamation<QuiescentReclamation>("quiescent states");
+  }
+}
+
+// Churn many small tables from every thread, each in a reclamation domain of
+// its own and all in one shared domain.
+void BenchmarkDomain() {
+  typedef LockFreeHashTable<int, int> Table;
+  const int n_tables = 256;
+  const int n = kElements2;
+  for (int round = 0; round < 3; ++round) {
+    for (bool shared : {false, true}) {
+      Table::Domain domain;
+      std::vector<std::unique_ptr<Table>> tables;
+      for (int t = 0; t < n_tables; ++t) {
+        tables.push_back(shared ? std::make_unique<Table>(domain)
+                                : std::make_unique<Table>());
+      }
+      double ms = RunConcurrently(kMaxThreads, [&](int i) {
+        for (int j = i; j < n; j += kMaxThreads) {
+          tables[j % n_tables]->Insert(j, j);
+        }
+        for (int j = i; j < n; j += kMaxThreads) {
+          tables[j % n_tables]->Delete(j);
+        }
+      });
+      std::cout << (shared ? "shared domain" : "domain per table") << ", "
+                << n_tables << " tables, churn timespan=" << ms << "ms"
+                << "\n";
+    }
+  }
+}
+
+// Time loading n items into a table which starts with default buckets, with
+// reserved buckets and with buckets initialized by all threads.
+void BenchmarkReserve() {
+  typedef LockFreeHashTable<int, int> Table;
+  const int n = kElements3;
+  std::vector<int> keys(n);
+  for (int i = 0; i < n; ++i) {
+    keys[i] = i;
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+  auto load = [&](Table& table) {
+    return RunConcurrently(kMaxThreads, [&](int i) {
+      for (int j = i; j < n; j += kMaxThreads) {
+        table.Insert(keys[j], j);
+      }
+    });
+  };
+
+  for (int round = 0; round < 3; ++round) {
+    {
+      Table table;
+      std::cout << n << " inserts from 2 buckets, timespan=" << load(table)
+                << "ms"
+                << "\n";
+    }
+    {
+      auto t1_ = std::chrono::steady_clock::now();
+      Table table(n);
+      auto t2_ = std::chrono::steady_clock::now();
+      double reserve_ms =
+          std::chrono::duration<double, std::milli>(t2_ - t1_).count();
+      std::cout << n << " inserts after Reserve, timespan="
+                << reserve_ms + load(table) << "ms"
+                << "\n";
+    }
+    {
+      auto t1_ = std::chrono::steady_clock::now();
+      Table table(n, kMaxThreads);
+      auto t2_ = std::chrono::steady_clock::now();
+      double reserve_ms =
+          std::chrono::duration<double, std::milli>(t2_ - t1_).count();
+      std::cout << n << " inserts after Reserve with initialized buckets, "
+                << "timespan=" << reserve_ms + load(table) << "ms ("
+                << reserve_ms << "ms to reserve)"
+                << "\n";
+    }
+  }
+}
+
+// Load n shuffled keys in batches, one Insert per key and one InsertBatch per
+// batch, into an empty table and over the same keys again.
+void BenchmarkBatch() {
+  typedef LockFreeHashTable<int, int> Table;
+  const int n = kElements3;
+  std::vector<std::pair<int, int>> items(n);
+  for (int i = 0; i < n; ++i) {
+    items[i] = {i, i};
+  }
+  std::shuffle(items.begin(), items.end(), std::mt19937(0));
+  auto load = [&](Table& table, size_t batch, bool batched) {
+    const int n_batches = (n + batch - 1) / batch;
+    return RunConcurrently(kMaxThreads, [&](int i) {
+      for (int b = i; b < n_batches; b += kMaxThreads) {
+        std::span<const std::pair<int, int>> span(items);
+        span = span.subspan(b * batch, std::min(batch, n - b * batch));
+        if (batched) {
+          table.InsertBatch(span);
+        } else {
+          for (const std::pair<int, int>& item : span) {
+            table.Insert(item.first, item.second);
+          }
+        }
+      }
+    });
+  };
+
+  for (int round = 0; round < 3; ++round) {
+    for (size_t batch : {64, 1024, 16384}) {
+      for (bool batched : {false, true}) {
+        Table table;
+        double insert_ms = load(table, batch, batched);
+        double update_ms = load(table, batch, batched);
+        std::cout << (batched ? "InsertBatch" : "Insert loop") << ", batch of "
+                  << batch << ", " << n << " inserts timespan=" << insert_ms
+                  << "ms, updates timespan=" << update_ms << "ms"
+                  << "\n";
+      }
+    }
+  }
+}
+
+// Look up random keys of a table of n items, one Find per key and one
+// FindBatch per batch. At 2^23 items, the most DefaultGeometry holds at its
+// load factor, the table is several times the size of a typical LLC.
+void MeasureFindBatch(int n) {
+  typedef LockFreeHashTable<int, int> Table;
+  std::vector<int> keys(n);
+  for (int i = 0; i < n; ++i) {
+    keys[i] = i;
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+  Table table(n, kMaxThreads);
+  RunConcurrently(kMaxThreads, [&](int i) {
+    for (int j = i; j < n; j += kMaxThreads) {
+      table.Insert(keys[j], j);
+    }
+  });
+
+  const int finds = 1 << 22;
+  for (size_t batch : {16, 64}) {
+    for (bool batched : {false, true}) {
+      double ms = RunConcurrently(kMaxThreads, [&](int i) {
+        std::mt19937 gen(i);
+        std::vector<int> lookups(batch);
+        std::vector<std::optional<int>> values(batch);
+        int value;
+        for (int j = 0; j < finds / kMaxThreads; j += batch) {
+          for (int& key : lookups) {
+            key = gen() % n;
+          }
+          if (batched) {
+            table.FindBatch(lookups, values);
+          } else {
+            for (int key : lookups) {
+              table.Find(key, value);
+            }
+          }
+        }
+      });
+      std::cout << (batched ? "FindBatch" : "Find loop") << ", batch of "
+                << batch << ", " << finds << " finds in " << n
+                << " elements, timespan=" << ms << "ms, " << finds / ms / 1000
+                << " Mops/s"
+                << "\n";
+    }
+  }
+}
+
+void BenchmarkFindBatch() {
+  for (int round = 0; round < 3; ++round) {
+    MeasureFindBatch(1 << 20);
+    MeasureFindBatch(1 << 23);
+  }
+}
+
+// Load and look up keys in list order, one at a time and through a Cursor,
+// in a table capped at 256 buckets so that each bucket holds a long chain.
+void BenchmarkCursor() {
+  typedef LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                            DefaultAllocator, FlatGeometry<8>>
+      Table;
+  const int n = 1 << 16;
+  std::vector<int> keys(n);
+  for (int i = 0; i < n; ++i) {
+    keys[i] = i;
+  }
+  std::sort(keys.begin(), keys.end(), [](int a, int b) {
+    return LockFreeHashTableTest::Reverse<Table>(a) <
+           LockFreeHashTableTest::Reverse<Table>(b);
+  });
+
+  for (int round = 0; round < 3; ++round) {
+    for (bool cursor : {false, true}) {
+      Table table;
+      double insert_ms = RunConcurrently(1, [&](int) {
+        typename Table::Cursor finger(table);
+        for (int key : keys) {
+          cursor ? finger.Insert(key, key) : table.Insert(key, key);
+        }
+      });
+      double find_ms = RunConcurrently(1, [&](int) {
+        typename Table::Cursor finger(table);
+        int value;
+        for (int key : keys) {
+          cursor ? finger.Find(key, value) : table.Find(key, value);
+        }
+      });
+      std::cout << (cursor ? "Cursor" : "Table") << ", " << n
+                << " inserts in list order, timespan=" << insert_ms
+                << "ms, finds timespan=" << find_ms << "ms"
+                << "\n";
+    }
+  }
+}
+
+// Scan tables of n items once with ForEach and once with an Iterator.
+void MeasureForEach(int n) {
+  typedef LockFreeHashTable<int, int> Table;
+  Table table(n, kMaxThreads);
+  RunConcurrently(kMaxThreads, [&](int i) {
+    for (int j = i; j < n; j += kMaxThreads) {
+      table.Insert(j, j);
+    }
+  });
+
+  for (bool iterator : {false, true}) {
+    long long sum = 0;
+    double ms = RunConcurrently(1, [&](int) {
+      if (iterator) {
+        typename Table::Iterator it(table);
+        int key, value;
+        while (it.Next(key, value)) {
+          sum += value;
+        }
+      } else {
+        table.ForEach([&](int, int value) { sum += value; });
+      }
+    });
+    assert(sum == static_cast<long long>(n) * (n - 1) / 2);
+    std::cout << (iterator ? "Iterator" : "ForEach") << ", " << n
+              << " elements, timespan=" << ms << "ms, " << n / ms / 1000
+              << " Mitems/s"
+              << "\n";
+  }
+}
+
+void BenchmarkForEach() {
+  for (int round = 0; round < 3; ++round) {
+    MeasureForEach(1 << 20);
+    MeasureForEach(1 << 23);
+  }
+}
+
+// Scan a table of 2^23 items with ParallelForEach on 1 up to kMaxThreads
+// threads.
+void BenchmarkParallelForEach() {
+  typedef LockFreeHashTable<int, int> Table;
+  const int n = 1 << 23;
+  Table table(n, kMaxThreads);
+  RunConcurrently(kMaxThreads, [&](int i) {
+    for (int j = i; j < n; j += kMaxThreads) {
+      table.Insert(j, j);
+    }
+  });
+
+  for (int round = 0; round < 3; ++round) {
+    for (int n_threads = 1;; n_threads = std::min(2 * n_threads, kMaxThreads)) {
+      std::atomic<long long> sum = 0;
+      double ms = RunConcurrently(1, [&](int) {
+        table.ParallelForEach(n_threads, [&](int, int value) {
+          sum.fetch_add(value, std::memory_order_relaxed);
+        });
+      });
+      assert(sum == static_cast<long long>(n) * (n - 1) / 2);
+      std::cout << "ParallelForEach, " << n_threads << " threads, " << n
+                << " elements, timespan=" << ms << "ms, " << n / ms / 1000
+                << " Mitems/s"
+                << "\n";
+      if (n_threads == kMaxThreads) break;
+    }
+  }
+}
+
+// Update random keys of a table of 2^20 items on kMaxThreads threads, with
+// and without versions, and with a thread which scans snapshots meanwhile.
+template <bool Snapshots>
+void MeasureSnapshotWrites(bool scan) {
+  typedef LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                            DefaultAllocator, DefaultGeometry,
+                            HazardPointerReclamation, Snapshots>
+      Table;
+  const int n = 1 << 20;
+  const int updates = 1 << 23;
+  Table table(n, kMaxThreads);
+  for (int i = 0; i < n; ++i) {
+    table.Insert(i, i);
+  }
+
+  std::atomic<bool> done = false;
+  int scans = 0;
+  std::thread scanner;
+  if constexpr (Snapshots) {
+    if (scan) {
+      scanner = std::thread([&] {
+        while (!done) {
+          typename Table::Snapshot snapshot(table);
+          int count = 0;
+          snapshot.ForEach([&](int, int) { ++count; });
+          assert(count == n);
+          ++scans;
+        }
+      });
+    }
+  }
+  double ms = RunConcurrently(kMaxThreads, [&](int i) {
+    std::mt19937 gen(i);
+    for (int j = 0; j < updates / kMaxThreads; ++j) {
+      table.Insert(gen() % n, j);
+    }
+  });
+  done = true;
+  if (scanner.joinable()) scanner.join();
+  std::cout << (Snapshots ? "Snapshots" : "Plain")
+            << (scan ? " with a scanner" : "") << ", " << updates
+            << " updates, timespan=" << ms << "ms, " << updates / ms / 1000
+            << " Mops/s";
+  if (scan) std::cout << ", " << scans << " snapshot scans";
+  std::cout << "\n";
+}
+
+// Scan a table of 2^20 items which keeps versions with ForEach and with a
+// Snapshot.
+void MeasureSnapshotScan() {
+  typedef LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                            DefaultAllocator, DefaultGeometry,
+                            HazardPointerReclamation, true>
+      Table;
+  const int n = 1 << 20;
+  Table table(n, kMaxThreads);
+  for (int i = 0; i < n; ++i) {
+    table.Insert(i, i);
+  }
+
+  for (bool snapshot : {false, true}) {
+    long long sum = 0;
+    double ms = RunConcurrently(1, [&](int) {
+      if (snapshot) {
+        typename Table::Snapshot(table).ForEach(
+            [&](int, int value) { sum += value; });
+      } else {
+        table.ForEach([&](int, int value) { sum += value; });
+      }
+    });
+    assert(sum == static_cast<long long>(n) * (n - 1) / 2);
+    std::cout << (snapshot ? "Snapshot" : "ForEach") << ", " << n
+              << " elements, timespan=" << ms << "ms, " << n / ms / 1000
+              << " Mitems/s"
+              << "\n";
+  }
+}
+
+void BenchmarkSnapshot() {
+  for (int round = 0; round < 3; ++round) {
+    MeasureSnapshotWrites<false>(false);
+    MeasureSnapshotWrites<true>(false);
+    MeasureSnapshotWrites<true>(true);
+    MeasureSnapshotScan();
+  }
+}
+
+// Reload a table of about n random keys from a file SaveTo wrote, once with
+// LoadFrom and once by reading the items and inserting them one at a time.
+void MeasureReload(int n) {
+  typedef LockFreeHashTable<int, int> Table;
+  std::FILE* file = std::tmpfile();
+  const int fd = fileno(file);
+  size_t size;
+  {
+    Table table(n, kMaxThreads);
+    RunConcurrently(kMaxThreads, [&](int i) {
+      std::mt19937 gen(i);
+      for (int j = i; j < n; j += kMaxThreads) {
+        table.Insert(gen(), j);
+      }
+    });
+    size = table.size_exact();
+    double ms = RunConcurrently(1, [&](int) { table.SaveTo(fd); });
+    std::cout << "SaveTo, " << size << " elements, timespan=" << ms << "ms, "
+              << lseek(fd, 0, SEEK_END) << " bytes"
+              << "\n";
+  }
+
+  for (bool insert : {false, true}) {
+    lseek(fd, 0, SEEK_SET);
+    Table table;
+    double ms = RunConcurrently(1, [&](int) {
+      if (!insert) {
+        table.LoadFrom(fd);
+        return;
+      }
+      // The same format, read item by item.
+      FileReader in(fd);
+      BinarySerializer serializer;
+      char header[16];
+      uint8_t tag;
+      in.Read(header, sizeof(header));
+      while (in.Read(&tag, sizeof(tag)) && 1 == tag) {
+        int key = *serializer.Load<int>(in);
+        table.Insert(key, *serializer.Load<int>(in));
+      }
+    });
+    assert(table.size_exact() == size);
+    std::cout << (insert ? "Insert" : "LoadFrom") << ", " << size
+              << " elements, timespan=" << ms << "ms, " << size / ms / 1000
+              << " Mitems/s"
+              << "\n";
+  }
+  std::fclose(file);
+}
+
+void BenchmarkReload() {
+  for (int round = 0; round < 3; ++round) {
+    MeasureReload(1 << 20);
+    MeasureReload(1 << 23);
+  }
+}
+
+// Hashes std::string, std::string_view and const char* alike.
+struct StringHash {
+  typedef void is_transparent;
+  size_t operator()(std::string_view key) const {
+    return std::hash<std::string_view>()(key);
+  }
+};
+
+void TestTransparentLookup() {
+  LockFreeHashTable<std::string, int, StringHash, std::equal_to<>> table;
+  for (int i = 0; i < kElements1; ++i) {
+    table.Insert(std::to_string(i), i);
+  }
+
+  int value = 0;
+  for (int i = 0; i < kElements1; ++i) {
+    std::string key = std::to_string(i);
+    assert(table.Find(std::string_view(key), value) && value == i);
+    assert(table.Find(key.c_str(), value) && value == i);
+  }
+  assert(!table.Find("not found", value));
+  assert(table.Delete(std::string_view("0")));
+  assert(!table.Find(std::string("0"), value));
+  assert(table.size_exact() == kElements1 - 1);
+}
+
+// A key with operator== but no operator<.
+struct Point {
+  bool operator==(const Point& other) const {
+    return x == other.x && y == other.y;
+  }
+  int x;
+  int y;
+};
+
+// Every point with the same x collides on the full hash.
+struct PointHash {
+  size_t operator()(const Point& point) const {
+    return std::hash<int>()(point.x);
+  }
+};
+
+void TestEqualityOnlyKey() {
+  const int kCollisions = 16;
+  LockFreeHashTable<Point, int, PointHash> table;
+  for (int x = 0; x < kElements1 / kCollisions; ++x) {
+    for (int y = 0; y < kCollisions; ++y) {
+      assert(table.Insert(Point{x, y}, x * kCollisions + y));
+    }
+  }
+  assert(!table.Insert(Point{0, 0}, -1));
+
+  int value;
+  assert(table.Find(Point{0, 0}, value) && value == -1);
+  for (int x = 0; x < kElements1 / kCollisions; ++x) {
+    for (int y = 1; y < kCollisions; ++y) {
+      assert(table.Find(Point{x, y}, value) && value == x * kCollisions + y);
+    }
+  }
+  assert(!table.Find(Point{0, kCollisions}, value));
+
+  assert(table.Delete(Point{1, kCollisions / 2}));
+  assert(!table.Delete(Point{1, kCollisions / 2}));
+  assert(table.Find(Point{1, kCollisions - 1}, value));
+  assert(table.Insert(Point{1, kCollisions / 2}, 0));
+  assert(table.Find(Point{1, kCollisions / 2}, value) && value == 0);
+  assert(table.size_exact() == kElements1 / kCollisions * kCollisions);
+}
+
+// Blocks of every size class, and above, hold their bytes apart from each
+// other. Blocks allocated on one thread are freed on another, and once both
+// threads exit a third one reuses them before it carves a new slab. A table
+// whose nodes come and go on many threads keeps its items.
+void TestSlabAllocator() {
+  std::vector<std::pair<unsigned char*, size_t>> blocks;
+  for (size_t size = 1; size <= 20 * 1024; size += size < 512 ? 7 : 509) {
+    for (int i = 0; i < 4; ++i) {
+      auto block = static_cast<unsigned char*>(SlabAllocator::Allocate(size));
+      assert(reinterpret_cast<uintptr_t>(block) % 16 == 0);
+      std::fill(block, block + size, static_cast<unsigned char>(size + i));
+      blocks.push_back({block, size});
+    }
+  }
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    auto [block, size] = blocks[i];
+    unsigned char fill = static_cast<unsigned char>(size + i % 4);
+    assert(std::all_of(block, block + size,
+                       [fill](unsigned char c) { return c == fill; }));
+  }
+  for (size_t i = 0; i < blocks.size(); i += 2) {
+    SlabAllocator::Deallocate(blocks[i].first, blocks[i].second);
+  }
+  for (size_t i = 1; i < blocks.size(); i += 2) {
+    SlabAllocator::Deallocate(blocks[i].first, blocks[i].second);
+  }
+
+  // A size class no other check uses, so that the third thread only finds
+  // the blocks of the first two.
+  const size_t kSize = 3000;
+  const int n = 1000;
+  std::vector<void*> freed;
+  std::thread([&] {
+    for (int i = 0; i < n; ++i) {
+      freed.push_back(SlabAllocator::Allocate(kSize));
+      static_cast<int*>(freed.back())[0] = i;
+    }
+  }).join();
+  std::thread([&] {
+    for (int i = 0; i < n; ++i) {
+      assert(static_cast<int*>(freed[i])[0] == i);
+      SlabAllocator::Deallocate(freed[i], kSize);
+    }
+  }).join();
+  std::sort(freed.begin(), freed.end());
+  std::thread([&] {
+    std::vector<void*> reused;
+    int found = 0;
+    // The slabs of the first thread hold fewer than a slab's worth of
+    // blocks besides the freed ones.
+    for (int i = 0; i < 2 * n && found < n; ++i) {
+      reused.push_back(SlabAllocator::Allocate(kSize));
+      if (std::binary_search(freed.begin(), freed.end(), reused.back())) {
+        ++found;
+      }
+    }
+    assert(found == n);
+    for (void* block : reused) SlabAllocator::Deallocate(block, kSize);
+  }).join();
+
+  LockFreeHashTable<int, std::string, std::hash<int>, std::equal_to<int>,
+                    SlabAllocator>
+      table;
+  const int n_threads = 8;
+  const int keys = kElements2;
+  RunConcurrently(n_threads, [&](int i) {
+    for (int j = i; j < keys; j += n_threads) {
+      table.Insert(j, std::to_string(j));
+    }
+    // Delete the keys another thread inserted.
+    for (int j = (i + 1) % n_threads; j < keys; j += n_threads) {
+      if (j % 2 == 0) {
+        // Wait for the key to be in.
+        while (!table.Delete(j)) std::this_thread::yield();
+      }
+    }
+  });
+  std::string value;
+  for (int j = 0; j < keys; ++j) {
+    assert(table.Find(j, value) == (j % 2 != 0));
+    if (j % 2 != 0) assert(value == std::to_string(j));
+  }
+}
+
+template <typename Geometry>
+void CheckGeometry(int n, size_t bucket_size) {
+  LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                    DefaultAllocator, Geometry>
+      table;
+  for (int i = 0; i < n; ++i) {
+    assert(table.Insert(i, i));
+  }
+  assert(LockFreeHashTableTest::BucketSize(table) == bucket_size);
+
+  int value;
+  for (int i = 0; i < n; ++i) {
+    assert(table.Find(i, value) && value == i);
+  }
+  for (int i = 0; i < n; i += 2) {
+    assert(table.Delete(i));
+  }
+  for (int i = 0; i < n; ++i) {
+    assert(table.Find(i, value) == (i % 2 == 1));
+  }
+  assert(table.size_exact() == static_cast<size_t>(n / 2));
+}
+
+void TestGeometry() {
+  // A flat array of 64 buckets stops growing once it is full.
+  CheckGeometry<SegmentGeometry<1, 64>>(kElements1, 64);
+  CheckGeometry<SegmentGeometry<2, 8>>(kElements1, 64);
+  // Two items per bucket, 2^16 buckets hold 100000 items.
+  CheckGeometry<SegmentGeometry<6, 16, std::ratio<2>>>(kElements2, 1 << 16);
+  CheckGeometry<DefaultGeometry>(kElements2, 1 << 18);
+  CheckGeometry<FlatGeometry<6>>(kElements1, 64);
+  CheckGeometry<FlatGeometry<30>>(kElements2, 1 << 18);
+}
+
+template <typename Geometry>
+void CheckShrink() {
+  LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                    DefaultAllocator, Geometry>
+      table;
+  for (int i = 0; i < kElements2; ++i) {
+    table.Insert(i, i);
+  }
+  assert(LockFreeHashTableTest::BucketSize(table) == 1 << 18);
 
+  // Below one item per 8 buckets the table halves its buckets.
+  const int kLeft = 10;
+  for (int i = kLeft; i < kElements2; ++i) {
+    assert(table.Delete(i));
+  }
+  assert(LockFreeHashTableTest::BucketSize(table) == 64);
+
+  int value;
+  for (int i = 0; i < kElements2; ++i) {
+    assert(table.Find(i, value) == (i < kLeft));
+  }
+  for (int i = 0; i < kElements2; ++i) {
+    table.Insert(i, -i);
+  }
+  for (int i = 0; i < kElements2; ++i) {
+    assert(table.Find(i, value) && value == -i);
+  }
+  assert(LockFreeHashTableTest::BucketSize(table) == 1 << 18);
+}
+
+// A Shrink empties the upper half a step per Insert or Delete, meanwhile
+// lookups and scans find every item through the lower half.
+template <typename Geometry>
+void CheckShrinkSteps() {
+  LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                    DefaultAllocator, Geometry>
+      table;
+  for (int i = 0; i < kElements2; ++i) {
+    table.Insert(i, i);
+  }
+  assert(LockFreeHashTableTest::BucketSize(table) == 1 << 18);
+
+  // The Shrink to 2^17 buckets starts below 2^15 items and takes 2^11 steps.
+  const int kLeft = (1 << 15) - 1000;
+  for (int i = kLeft; i < kElements2; ++i) {
+    assert(table.Delete(i));
+  }
+  assert(LockFreeHashTableTest::BucketSize(table) == 1 << 17);
+
+  int value;
+  for (int i = 0; i < kElements2; ++i) {
+    assert(table.Find(i, value) == (i < kLeft));
+  }
+  std::vector<std::atomic<int>> seen(kLeft);
+  table.ParallelForEach(4, [&](int key, int) {
+    assert(key < kLeft);
+    seen[key].fetch_add(1, std::memory_order_relaxed);
+  });
+  for (int i = 0; i < kLeft; ++i) {
+    assert(seen[i] == 1);
+  }
+  table.Reserve(kElements2);
+  assert(LockFreeHashTableTest::BucketSize(table) == 1 << 18);
+}
+
+// Threads grow and shrink the table over their own keys, those which still
+// use the old bucket size meet the buckets, segments and pages a Shrink
+// releases.
+template <typename Geometry>
+void CheckShrinkConcurrently() {
+  LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                    DefaultAllocator, Geometry>
+      table;
+  const int n_threads = 4;
+  const int n = 1 << 15;
+  RunConcurrently(n_threads, [&](int i) {
+    int value;
+    for (int round = 0; round < 10; ++round) {
+      for (int key = i; key < n; key += n_threads) {
+        table.Insert(key, key + round);
+      }
+      for (int key = i; key < n; key += n_threads) {
+        assert(table.Find(key, value) && value == key + round);
+      }
+      for (int key = i; key < n; key += n_threads) {
+        assert(table.Delete(key));
+      }
+      for (int key = i; key < n; key += n_threads) {
+        assert(!table.Find(key, value));
+      }
+    }
+  });
+  assert(table.size_exact() == 0);
+}
+
+void TestShrink() {
+  CheckShrink<SegmentGeometry<4, 64, std::ratio<1, 2>, std::ratio<1, 8>>>();
+  CheckShrink<SegmentGeometry<9, 4, std::ratio<1, 2>, std::ratio<1, 8>>>();
+  CheckShrink<FlatGeometry<20, std::ratio<1, 2>, std::ratio<1, 8>>>();
+  CheckShrinkSteps<
+      SegmentGeometry<4, 64, std::ratio<1, 2>, std::ratio<1, 8>>>();
+  CheckShrinkSteps<SegmentGeometry<9, 4, std::ratio<1, 2>, std::ratio<1, 8>>>();
+  CheckShrinkSteps<FlatGeometry<20, std::ratio<1, 2>, std::ratio<1, 8>>>();
+  CheckShrinkConcurrently<
+      SegmentGeometry<4, 64, std::ratio<1, 2>, std::ratio<1, 8>>>();
+  CheckShrinkConcurrently<
+      SegmentGeometry<9, 4, std::ratio<1, 2>, std::ratio<1, 8>>>();
+  CheckShrinkConcurrently<
+      FlatGeometry<20, std::ratio<1, 2>, std::ratio<1, 8>>>();
+}
+
+template <typename Geometry>
+void CheckReserve(int n, size_t bucket_size) {
+  typedef LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                            DefaultAllocator, Geometry>
+      Table;
+  Table table(n);
+  assert(LockFreeHashTableTest::BucketSize(table) == bucket_size);
+  assert(LockFreeHashTableTest::GetBucketHead(table, bucket_size - 1) ==
+         nullptr);
+  // Reserving less does not shrink the table.
+  table.Reserve(0, 4);
+  assert(LockFreeHashTableTest::BucketSize(table) == bucket_size);
+  for (size_t i = 0; i < bucket_size; ++i) {
+    assert(LockFreeHashTableTest::GetBucketHead(table, i) != nullptr);
+  }
+
+  for (int i = 0; i < n; ++i) {
+    assert(table.Insert(i, i));
+  }
+  assert(LockFreeHashTableTest::BucketSize(table) == bucket_size);
+  int value;
+  for (int i = 0; i < n; ++i) {
+    assert(table.Find(i, value) && value == i);
+  }
+}
+
+void TestReserve() {
+  CheckReserve<DefaultGeometry>(kElements2, 1 << 18);
+  // Capped by the directory.
+  CheckReserve<SegmentGeometry<2, 8>>(kElements1, 64);
+  CheckReserve<FlatGeometry<20>>(kElements2, 1 << 18);
+}
+
+// Count from more threads than the counter has stripes.
+void TestSize() {
+  LockFreeHashTable<int, int> table;
+  const int n_threads = 100;
+  const int n = kElements2;
+  RunConcurrently(n_threads, [&](int i) {
+    for (int j = i; j < n; j += n_threads) {
+      table.Insert(j, j);
+    }
+  });
+  assert(table.size_exact() == static_cast<size_t>(n));
+  assert(table.size() <= static_cast<size_t>(n));
+  assert(table.size() >= static_cast<size_t>(n - n / 8));
+
+  RunConcurrently(n_threads, [&](int i) {
+    for (int j = i; j < n; j += n_threads) {
+      table.Delete(j);
+    }
+  });
+  assert(table.size_exact() == 0);
+  for (int i = 0; i < kElements1; ++i) {
+    table.Insert(i, i);
+  }
+  assert(table.size_exact() == static_cast<size_t>(kElements1));
+}
+
+// Growth keeps up with inserts from many threads, checked by GetStats.
+void TestStats() {
+  typedef LockFreeHashTable<int, int> Table;
+  Table table;
+  const int n_threads = 100;
+  const int n = kElements2;
+  RunConcurrently(n_threads, [&](int i) {
+    for (int j = i; j < n; j += n_threads) {
+      table.Insert(j, j);
+    }
+  });
+  assert(LockFreeHashTableTest::BucketSize(table) == 1 << 18);
+
+  Table::Stats stats = table.GetStats();
+  assert(stats.size == static_cast<size_t>(n));
+  assert(stats.bucket_size == 1 << 18);
+  assert(stats.dummy_nodes <= stats.bucket_size);
+  assert(stats.load_factor <= 0.5);
+  assert(stats.average_chain >= 1 && stats.average_chain <= stats.max_chain);
+
+  // Every item of one bucket.
+  LockFreeHashTable<Point, int, PointHash> collisions;
+  for (int y = 0; y < kElements1; ++y) {
+    collisions.Insert(Point{0, y}, y);
+  }
+  auto collision_stats = collisions.GetStats();
+  assert(collision_stats.size == static_cast<size_t>(kElements1));
+  assert(collision_stats.max_chain == static_cast<size_t>(kElements1));
+  assert(collision_stats.average_chain == kElements1);
+}
+
+// Concurrent churn with epochs, values stored out of line are retired too.
+template <typename Geometry>
+void CheckEpochReclamation() {
+  LockFreeHashTable<int, std::string, std::hash<int>, std::equal_to<int>,
+                    DefaultAllocator, Geometry, EpochReclamation>
+      table;
+  const int n_threads = 8;
+  const int n = kElements2;
+  RunConcurrently(n_threads, [&](int i) {
+    for (int round = 0; round < 5; ++round) {
+      for (int j = i; j < n; j += n_threads) {
+        table.Insert(j, std::to_string(j));
+        table.Insert(j, std::to_string(-j));
+      }
+      std::string value;
+      for (int j = i; j < n; j += n_threads) {
+        assert(table.Find(j, value) && value == std::to_string(-j));
+      }
+      for (int j = i; j < n; j += n_threads) {
+        if (round < 4 || j % 2 == 0) assert(table.Delete(j));
+      }
+    }
+  });
+  assert(table.size_exact() == static_cast<size_t>(n / 2));
+  std::string value;
+  for (int i = 0; i < n; ++i) {
+    assert(table.Find(i, value) == (i % 2 == 1));
+  }
+}
+
+void TestEpochReclamation() {
+  CheckEpochReclamation<DefaultGeometry>();
+  CheckEpochReclamation<
+      SegmentGeometry<4, 64, std::ratio<1, 2>, std::ratio<1, 8>>>();
+}
+
+// Registered threads churn and quiesce between passes while an unregistered
+// thread keeps reading, it announces itself per operation.
+template <typename Geometry>
+void CheckQuiescentReclamation() {
+  LockFreeHashTable<int, std::string, std::hash<int>, std::equal_to<int>,
+                    DefaultAllocator, Geometry, QuiescentReclamation>
+      table;
+  const int n_threads = 8;
+  const int n = kElements2;
+  std::atomic<bool> done(false);
+  std::thread reader([&] {
+    std::string value;
+    for (int j = 0; !done; j = (j + 1) % n) {
+      if (table.Find(j, value)) {
+        assert(value == std::to_string(j) || value == std::to_string(-j));
+      }
+    }
+  });
+  RunConcurrently(n_threads, [&](int i) {
+    table.RegisterThread();
+    for (int round = 0; round < 5; ++round) {
+      for (int j = i; j < n; j += n_threads) {
+        table.Insert(j, std::to_string(j));
+        table.Insert(j, std::to_string(-j));
+      }
+      table.Quiesce();
+      std::string value;
+      for (int j = i; j < n; j += n_threads) {
+        assert(table.Find(j, value) && value == std::to_string(-j));
+      }
+      table.Quiesce();
+      for (int j = i; j < n; j += n_threads) {
+        if (round < 4 || j % 2 == 0) assert(table.Delete(j));
+      }
+      table.Quiesce();
+    }
+    // Half of the threads exit while still registered.
+    if (i % 2 == 0) table.UnregisterThread();
+  });
+  done = true;
+  reader.join();
+  assert(table.size_exact() == static_cast<size_t>(n / 2));
+  std::string value;
+  for (int i = 0; i < n; ++i) {
+    assert(table.Find(i, value) == (i % 2 == 1));
+  }
+}
+
+void TestQuiescentReclamation() {
+  CheckQuiescentReclamation<DefaultGeometry>();
+  CheckQuiescentReclamation<
+      SegmentGeometry<4, 64, std::ratio<1, 2>, std::ratio<1, 8>>>();
+}
+
+// Tables of different types share a domain and a thread quiesces once for
+// both. Tables die before and after the threads which used them.
+void TestReclamationDomain() {
+  typedef LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                            DefaultAllocator, DefaultGeometry,
+                            QuiescentReclamation>
+      IntTable;
+  typedef LockFreeHashTable<int, std::string, std::hash<int>,
+                            std::equal_to<int>, DefaultAllocator,
+                            DefaultGeometry, QuiescentReclamation>
+      StringTable;
+  const int n_threads = 8;
+  const int n = kElements1;
+  QuiescentReclamation::Domain domain;
+  IntTable ints(domain);
+  StringTable strings(ints.domain());
+  RunConcurrently(n_threads, [&](int i) {
+    domain.RegisterThread();
+    for (int round = 0; round < 5; ++round) {
+      for (int j = i; j < n; j += n_threads) {
+        ints.Insert(j, j);
+        strings.Insert(j, std::to_string(j));
+      }
+      domain.Quiesce();
+      for (int j = i; j < n; j += n_threads) {
+        assert(ints.Delete(j) && strings.Delete(j));
+      }
+      domain.Quiesce();
+    }
+    domain.UnregisterThread();
+
+    // Tables which die before the thread, each in a domain of its own.
+    for (int t = 0; t < 50; ++t) {
+      LockFreeHashTable<int, int> table;
+      for (int j = 0; j < 100; ++j) {
+        table.Insert(j, j);
+      }
+      for (int j = 0; j < 100; ++j) {
+        assert(table.Delete(j));
+      }
+    }
+  });
+  assert(ints.size_exact() == 0 && strings.size_exact() == 0);
+
+  // A table which dies on another thread while this one still runs.
+  auto table = std::make_unique<LockFreeHashTable<int, std::string>>();
+  std::atomic<int> step(0);
+  std::thread user([&] {
+    for (int j = 0; j < n; ++j) {
+      table->Insert(j, std::to_string(j));
+      assert(table->Delete(j));
+    }
+    step = 1;
+    while (step != 2) {
+      std::this_thread::yield();
+    }
+  });
+  while (step != 1) {
+    std::this_thread::yield();
+  }
+  table.reset();
+  step = 2;
+  user.join();
+}
+
+// A value which counts its live copies.
+struct Counted {
+  static inline std::atomic<int> live = 0;
+
+  explicit Counted(int i) : i(i) { ++live; }
+  Counted(const Counted& other) : i(other.i) { ++live; }
+  ~Counted() { --live; }
+
+  int i;
+};
+
+// Flush frees a single retired node, which is far below the batch a
+// reclaimer collects on its own. Once the threads which churned are gone,
+// Flush frees everything they retired, on a plain and on a registered thread.
+template <typename Reclamation>
+void CheckFlush() {
+  {
+    LockFreeHashTable<int, Counted, std::hash<int>, std::equal_to<int>,
+                      DefaultAllocator, DefaultGeometry, Reclamation>
+        table;
+    table.Insert(1, Counted(1));
+    assert(table.Delete(1));
+    assert(Counted::live == 1);
+    table.Flush();
+    assert(Counted::live == 0);
+  }
+  {
+    LockFreeHashTable<int, Counted, std::hash<int>, std::equal_to<int>,
+                      DefaultAllocator, DefaultGeometry, Reclamation>
+        table;
+    const int n_threads = 8;
+    const int n = kElements2;
+    RunConcurrently(n_threads, [&](int i) {
+      table.RegisterThread();
+      for (int j = i; j < n; j += n_threads) {
+        table.Insert(j, Counted(j));
+        table.Insert(j, Counted(-j));
+      }
+      table.Quiesce();
+      for (int j = i; j < n; j += n_threads) {
+        if (j % 4 != 0) assert(table.Delete(j));
+      }
+      table.UnregisterThread();
+    });
+    table.Flush();
+    assert(Counted::live == n / 4);
+
+    table.RegisterThread();
+    for (int j = 0; j < n; j += 4) {
+      assert(table.Delete(j));
+    }
+    table.Flush();
+    assert(Counted::live == 0);
+    table.UnregisterThread();
+  }
+  assert(Counted::live == 0);
+}
+
+void TestFlush() {
+  CheckFlush<HazardPointerReclamation>();
+  CheckFlush<EpochReclamation>();
+  CheckFlush<QuiescentReclamation>();
+}
+
+// InsertBatch agrees with Insert in a loop: later items win, the count is of
+// new keys, and it runs concurrently with itself and with Delete.
+template <typename Geometry>
+void CheckInsertBatch() {
+  LockFreeHashTable<int, std::string, std::hash<int>, std::equal_to<int>,
+                    DefaultAllocator, Geometry>
+      table;
+  std::vector<std::pair<int, std::string>> items;
+  for (int i = 0; i < kElements1; ++i) {
+    items.push_back({i % (kElements1 / 2), std::to_string(i)});
+  }
+  assert(table.InsertBatch(items) == static_cast<size_t>(kElements1 / 2));
+  assert(table.InsertBatch({}) == 0);
+  std::string value;
+  for (int i = 0; i < kElements1 / 2; ++i) {
+    assert(table.Find(i, value) && value == std::to_string(i + kElements1 / 2));
+  }
+
+  const int n_threads = 8;
+  const int n = kElements2;
+  RunConcurrently(n_threads, [&](int i) {
+    std::mt19937 gen(i);
+    std::vector<std::pair<int, std::string>> batch;
+    for (int round = 0; round < 20; ++round) {
+      batch.clear();
+      for (int j = 0; j < 1000; ++j) {
+        int key = gen() % n;
+        batch.push_back({key, std::to_string(key)});
+      }
+      table.InsertBatch(batch);
+      for (int j = 0; j < 500; ++j) {
+        table.Delete(gen() % n);
+      }
+    }
+  });
+  std::vector<std::pair<int, std::string>> all;
+  for (int i = 0; i < n; ++i) {
+    all.push_back({i, std::to_string(i)});
+  }
+  size_t missing = n - table.size_exact();
+  assert(table.InsertBatch(all) == missing);
+  assert(table.size_exact() == static_cast<size_t>(n));
+  for (int i = 0; i < n; ++i) {
+    assert(table.Find(i, value) && value == std::to_string(i));
+  }
+
+  // Keys which share the full hash.
+  LockFreeHashTable<Point, int, PointHash> collisions;
+  std::vector<std::pair<Point, int>> points;
+  for (int i = 0; i < 64; ++i) {
+    points.push_back({Point{i % 4, i % 16}, i});
+  }
+  assert(collisions.InsertBatch(points) == 16);
+  int y = 0;
+  for (int i = 48; i < 64; ++i) {
+    assert(collisions.Find(Point{i % 4, i % 16}, y) && y == i);
+  }
+}
+
+// Distinct hashes which all fall into bucket 0 for the first 2^32 buckets.
+struct HighBitsHash {
+  size_t operator()(int key) const { return static_cast<size_t>(key) << 32; }
+};
+
+// Every batch is a single run through one bucket, searched on from the last
+// node while other threads delete those nodes.
+void CheckInsertBatchRuns() {
+  LockFreeHashTable<int, int, HighBitsHash> table;
+  const int n_threads = 8;
+  const int n = 256;
+  RunConcurrently(n_threads, [&](int i) {
+    std::mt19937 gen(i);
+    std::vector<std::pair<int, int>> batch;
+    for (int round = 0; round < 200; ++round) {
+      batch.clear();
+      for (int j = 0; j < 64; ++j) {
+        int key = gen() % n;
+        batch.push_back({key, key});
+      }
+      table.InsertBatch(batch);
+      for (int j = 0; j < 32; ++j) {
+        table.Delete(gen() % n);
+      }
+    }
+  });
+  std::vector<std::pair<int, int>> all;
+  for (int i = 0; i < n; ++i) {
+    all.push_back({i, -i});
+  }
+  size_t missing = n - table.size_exact();
+  assert(table.InsertBatch(all) == missing);
+  int value = 0;
+  for (int i = 0; i < n; ++i) {
+    assert(table.Find(i, value) && value == -i);
+  }
+}
+
+// Batches are sorted by the buckets of the table when they start, a Shrink
+// meanwhile merges buckets whose items are then out of list order. One
+// thread grows and shrinks the table over odd keys while the others insert
+// sparse batches of even keys, each of which is found afterwards.
+void CheckInsertBatchShrink() {
+  LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                    DefaultAllocator,
+                    SegmentGeometry<4, 64, std::ratio<1, 2>, std::ratio<1, 8>>>
+      table;
+  const int n_threads = 4;
+  const int n = 1 << 16;
+  std::atomic<int> done = 0;
+  RunConcurrently(n_threads + 1, [&](int i) {
+    if (i == n_threads) {
+      while (done != n_threads) {
+        for (int key = 1; key < n; key += 2) table.Insert(key, key);
+        for (int key = 1; key < n; key += 2) table.Delete(key);
+      }
+      return;
+    }
+    std::mt19937 gen(i);
+    std::vector<std::pair<int, int>> batch;
+    for (int round = 0; round < 20000; ++round) {
+      batch.clear();
+      for (int j = 0; j < 32; ++j) {
+        int key = (gen() % (n / 2 / n_threads) * n_threads + i) * 2;
+        batch.push_back({key, key});
+      }
+      table.InsertBatch(batch);
+      int value = 0;
+      for (const std::pair<int, int>& item : batch) {
+        assert(table.Find(item.first, value) && value == item.first);
+      }
+      for (const std::pair<int, int>& item : batch) table.Delete(item.first);
+    }
+    ++done;
+  });
+}
+
+void TestInsertBatch() {
+  CheckInsertBatchRuns();
+  CheckInsertBatchShrink();
+  CheckInsertBatch<DefaultGeometry>();
+  CheckInsertBatch<
+      SegmentGeometry<4, 64, std::ratio<1, 2>, std::ratio<1, 8>>>();
+}
+
+// FindBatch agrees with Find, also on keys which are missing and while other
+// threads insert and delete. Even keys stay in the table throughout, odd keys
+// come and go, and under a shrinkable geometry so do the buckets.
+template <typename Geometry, typename Reclamation>
+void CheckFindBatch() {
+  LockFreeHashTable<int, std::string, std::hash<int>, std::equal_to<int>,
+                    DefaultAllocator, Geometry, Reclamation>
+      table;
+  const int n = kElements2;
+  for (int i = 0; i < n; i += 2) {
+    table.Insert(i, std::to_string(i));
+  }
+  std::vector<int> keys;
+  for (int i = -5; i < n + 5; ++i) {
+    keys.push_back(i);
+  }
+  std::vector<std::optional<std::string>> values(keys.size(), "stale");
+  assert(table.FindBatch(keys, values) == static_cast<size_t>(n / 2));
+  for (size_t i = 0; i < keys.size(); ++i) {
+    bool present = keys[i] >= 0 && keys[i] < n && keys[i] % 2 == 0;
+    assert(values[i].has_value() == present);
+    assert(!present || *values[i] == std::to_string(keys[i]));
+  }
+  assert(table.FindBatch({}, {}) == 0);
+
+  const int n_threads = 8;
+  RunConcurrently(n_threads, [&](int i) {
+    std::mt19937 gen(i);
+    std::vector<int> batch(37);
+    std::vector<std::optional<std::string>> found(batch.size());
+    for (int round = 0; round < 500; ++round) {
+      if (i % 2 == 0) {
+        for (int& key : batch) {
+          key = gen() % n;
+        }
+        table.FindBatch(batch, found);
+        for (size_t j = 0; j < batch.size(); ++j) {
+          assert(batch[j] % 2 == 1 || found[j].has_value());
+          assert(!found[j] || *found[j] == std::to_string(batch[j]));
+        }
+      } else {
+        for (int j = 0; j < 64; ++j) {
+          int key = gen() % n | 1;
+          if (round % 20 < 10) {
+            table.Insert(key, std::to_string(key));
+          } else {
+            table.Delete(key);
+          }
+        }
+      }
+    }
+  });
+}
+
+void TestFindBatch() {
+  CheckFindBatch<DefaultGeometry, HazardPointerReclamation>();
+  CheckFindBatch<SegmentGeometry<4, 64, std::ratio<1, 2>, std::ratio<1, 8>>,
+                 HazardPointerReclamation>();
+  CheckFindBatch<FlatGeometry<20, std::ratio<1, 2>, std::ratio<1, 8>>,
+                 EpochReclamation>();
+  CheckFindBatch<SegmentGeometry<1, 1024>, QuiescentReclamation>();
+  // The lookups of a group take turns over directory levels which Shrink
+  // retires, and over chains of hundreds of nodes.
+  CheckFindBatch<SegmentGeometry<9, 4, std::ratio<1, 2>, std::ratio<1, 8>>,
+                 HazardPointerReclamation>();
+  CheckFindBatch<SegmentGeometry<2, 8>, HazardPointerReclamation>();
+}
+
+// Operations through a Cursor agree with the plain ones, for keys in list
+// order and in random order, and while other threads insert and delete. Even
+// keys stay in the table throughout, odd keys come and go.
+template <typename Hash, typename Geometry, typename Reclamation>
+void CheckCursor(int n) {
+  typedef LockFreeHashTable<int, int, Hash, std::equal_to<int>,
+                            DefaultAllocator, Geometry, Reclamation>
+      Table;
+  Table table;
+  std::vector<int> keys(n);
+  for (int i = 0; i < n; ++i) {
+    keys[i] = i;
+  }
+  std::sort(keys.begin(), keys.end(), [](int a, int b) {
+    return LockFreeHashTableTest::Reverse<Table>(Hash()(a)) <
+           LockFreeHashTableTest::Reverse<Table>(Hash()(b));
+  });
+  int value = 0;
+  {
+    typename Table::Cursor cursor(table);
+    for (int key : keys) {
+      assert(cursor.Insert(key, key));
+    }
+    assert(!cursor.Insert(keys[0], keys[0]));
+    for (int key : keys) {
+      assert(cursor.Find(key, value) && value == key);
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+    for (int key : keys) {
+      assert(cursor.Find(key, value) && value == key);
+      if (key % 2 == 1) assert(cursor.Delete(key));
+    }
+    assert(!cursor.Delete(1));
+    assert(!cursor.Find(n + 1, value));
+  }
+  assert(table.size_exact() == static_cast<size_t>((n + 1) / 2));
+  for (int i = 0; i < n; ++i) {
+    assert(table.Find(i, value) == (i % 2 == 0));
+  }
+
+  const int n_threads = 8;
+  RunConcurrently(n_threads, [&](int i) {
+    std::mt19937 gen(i);
+    table.RegisterThread();
+    int found = 0;
+    for (int round = 0; round < 200; ++round) {
+      {
+        typename Table::Cursor cursor(table);
+        int key = gen() % n;
+        for (int j = 0; j < 32; ++j) {
+          key = (key + gen() % 4) % n;
+          if (key % 2 == 0) {
+            assert(cursor.Find(key, found) && found == key);
+          } else if (gen() % 2 == 0) {
+            cursor.Insert(key, key);
+          } else {
+            cursor.Delete(key);
+          }
+        }
+      }
+      table.Quiesce();
+    }
+    table.UnregisterThread();
+  });
+  for (int i = 0; i < n; i += 2) {
+    assert(table.Find(i, value) && value == i);
+  }
+}
+
+void TestCursor() {
+  CheckCursor<std::hash<int>, DefaultGeometry, HazardPointerReclamation>(
+      kElements1);
+  CheckCursor<HighBitsHash, DefaultGeometry, HazardPointerReclamation>(256);
+  CheckCursor<std::hash<int>,
+              SegmentGeometry<4, 64, std::ratio<1, 2>, std::ratio<1, 8>>,
+              EpochReclamation>(kElements1);
+  CheckCursor<HighBitsHash, FlatGeometry<10>, QuiescentReclamation>(256);
+}
+
+// ForEach and an Iterator visit every item once in list order, and while
+// other threads churn odd keys and update even ones, every even key once.
+template <typename Geometry, typename Reclamation>
+void CheckForEach() {
+  typedef LockFreeHashTable<int, std::string, std::hash<int>,
+                            std::equal_to<int>, DefaultAllocator, Geometry,
+                            Reclamation>
+      Table;
+  Table table;
+  const int n = kElements1;
+  for (int i = 0; i < n; ++i) {
+    table.Insert(i, std::to_string(i));
+  }
+  std::vector<int> seen(n);
+  size_t last = 0;
+  table.ForEach([&](int key, const std::string& value) {
+    assert(value == std::to_string(key));
+    size_t reverse = LockFreeHashTableTest::Reverse<Table>(key);
+    assert(reverse >= last);
+    last = reverse;
+    ++seen[key];
+  });
+  {
+    typename Table::Iterator it(table);
+    int key;
+    std::string value;
+    while (it.Next(key, value)) {
+      assert(value == std::to_string(key));
+      ++seen[key];
+    }
+    assert(!it.Next(key, value));
+  }
+  for (int i = 0; i < n; ++i) {
+    assert(seen[i] == 2);
+  }
+
+  const int n_threads = 8;
+  RunConcurrently(n_threads, [&](int i) {
+    if (i % 2 == 0) {
+      std::mt19937 gen(i);
+      for (int j = 0; j < 20 * n; ++j) {
+        int key = gen() % n;
+        if (key % 2 == 0 || gen() % 2 == 0) {
+          table.Insert(key, std::to_string(key));
+        } else {
+          table.Delete(key);
+        }
+      }
+      return;
+    }
+    for (int round = 0; round < 10; ++round) {
+      std::vector<int> counts(n);
+      if (round % 2 == 0) {
+        table.ForEach([&](int key, const std::string& value) {
+          assert(value == std::to_string(key));
+          ++counts[key];
+        });
+      } else {
+        typename Table::Iterator it(table);
+        int key;
+        std::string value;
+        while (it.Next(key, value)) {
+          assert(value == std::to_string(key));
+          ++counts[key];
+        }
+      }
+      for (int j = 0; j < n; ++j) {
+        assert(counts[j] <= 1 && (j % 2 == 1 || counts[j] == 1));
+      }
+    }
+  });
+}
+
+void TestForEach() {
+  CheckForEach<DefaultGeometry, HazardPointerReclamation>();
+  CheckForEach<SegmentGeometry<4, 64, std::ratio<1, 2>, std::ratio<1, 8>>,
+               HazardPointerReclamation>();
+  CheckForEach<FlatGeometry<16>, EpochReclamation>();
+}
+
+// ParallelForEach visits every item once, and while other threads churn odd
+// keys, every even key once.
+template <typename Geometry, typename Reclamation>
+void CheckParallelForEach(int scan_threads) {
+  typedef LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                            DefaultAllocator, Geometry, Reclamation>
+      Table;
+  Table table;
+  const int n = kElements2;
+  for (int i = 0; i < n; ++i) {
+    table.Insert(i, i);
+  }
+  std::vector<std::atomic<int>> seen(n);
+  table.ParallelForEach(scan_threads, [&](int key, int value) {
+    assert(key == value);
+    seen[key].fetch_add(1, std::memory_order_relaxed);
+  });
+  for (int i = 0; i < n; ++i) {
+    assert(seen[i] == 1);
+  }
+
+  std::atomic<bool> done = false;
+  std::thread scanner([&] {
+    for (int round = 0; round < 5; ++round) {
+      std::vector<std::atomic<int>> counts(n);
+      table.ParallelForEach(scan_threads, [&](int key, int) {
+        counts[key].fetch_add(1, std::memory_order_relaxed);
+      });
+      for (int j = 0; j < n; ++j) {
+        assert(counts[j] <= 1 && (j % 2 == 1 || counts[j] == 1));
+      }
+    }
+    done = true;
+  });
+  RunConcurrently(4, [&](int i) {
+    std::mt19937 gen(i);
+    while (!done) {
+      int key = (gen() % (n / 2)) * 2 + 1;
+      if (gen() % 2 == 0) {
+        table.Insert(key, key);
+      } else {
+        table.Delete(key);
+      }
+    }
+  });
+  scanner.join();
+}
+
+void TestParallelForEach() {
+  CheckParallelForEach<DefaultGeometry, HazardPointerReclamation>(4);
+  CheckParallelForEach<SegmentGeometry<4, 64, std::ratio<1, 2>,
+                                       std::ratio<1, 8>>,
+                       EpochReclamation>(3);
+  CheckParallelForEach<FlatGeometry<4>, HazardPointerReclamation>(8);
+}
+
+// A Snapshot shows the table as it was at one point. Each writer updates and
+// deletes its keys in order, round after round, so a snapshot sees its keys
+// up to some key in one round and the rest in the round before.
+template <typename Geometry, typename Reclamation>
+void CheckSnapshot() {
+  typedef LockFreeHashTable<int, int, std::hash<int>, std::equal_to<int>,
+                            DefaultAllocator, Geometry, Reclamation, true>
+      Table;
+  const int n_writers = 4;
+  const int m = kElements1 / n_writers;  // Keys per writer.
+  const int n = n_writers * m;
+  // The value of the keys after a round, -1 when deleted.
+  auto state = [](int round) { return round % 3 == 2 ? -1 : round; };
+  Table table;
+  for (int i = 0; i < n; ++i) {
+    table.Insert(i, 0);
+  }
+
+  int value;
+  {
+    typename Table::Snapshot snapshot(table);
+    assert(!table.Insert(0, 1));
+    assert(table.Delete(1));
+    assert(!table.Delete(1));
+    assert(table.Insert(n, 1));
+    assert(table.size_exact() == static_cast<size_t>(n));
+    assert(table.Find(0, value) && value == 1);
+    assert(!table.Find(1, value));
+    assert(snapshot.Find(0, value) && value == 0);
+    assert(snapshot.Find(1, value) && value == 0);
+    assert(!snapshot.Find(n, value));
+    int count = 0;
+    snapshot.ForEach([&](int key, int value) {
+      assert(key < n && value == 0);
+      ++count;
+    });
+    assert(count == n);
+    // Revives the deleted item.
+    assert(table.Insert(1, 0));
+    assert(table.Delete(n));
+  }
+  assert(table.size_exact() == static_cast<size_t>(n));
+
+  std::atomic<bool> done = false;
+  std::thread reader([&] {
+    for (int round = 0; round < 20; ++round) {
+      typename Table::Snapshot snapshot(table);
+      std::vector<int> seen(n, -1);
+      snapshot.ForEach([&](int key, int value) {
+        assert(seen[key] == -1 && value >= 0);
+        seen[key] = value;
+      });
+      for (int w = 0; w < n_writers; ++w) {
+        auto at = [&](int j) { return seen[j * n_writers + w]; };
+        int last = 1;
+        for (int j = 0; j < m; ++j) {
+          last = std::max(last, at(j));
+        }
+        bool consistent = false;
+        for (int r = last; r <= last + 3 && !consistent; ++r) {
+          int j = 0;
+          while (j < m && at(j) == state(r)) ++j;
+          while (j < m && at(j) == state(r - 1)) ++j;
+          consistent = j == m;
+        }
+        assert(consistent);
+      }
+      for (int i = 0; i < n; i += 7) {
+        bool found = snapshot.Find(i, value);
+        assert(found == (seen[i] != -1) && (!found || value == seen[i]));
+      }
+    }
+    done = true;
+  });
+  RunConcurrently(n_writers, [&](int w) {
+    for (int round = 1; !done; ++round) {
+      for (int j = 0; j < m; ++j) {
+        int key = j * n_writers + w;
+        if (state(round) < 0) {
+          table.Delete(key);
+        } else {
+          table.Insert(key, round);
+        }
+      }
+    }
+  });
+  reader.join();
+
+  int count = 0;
+  table.ForEach([&](int, int) { ++count; });
+  assert(table.size_exact() == static_cast<size_t>(count));
+}
+
+void TestSnapshot() {
+  CheckSnapshot<DefaultGeometry, HazardPointerReclamation>();
+  CheckSnapshot<SegmentGeometry<4, 64, std::ratio<1, 2>, std::ratio<1, 8>>,
+                EpochReclamation>();
+}
+
+// Values written as their element count and elements, to check a
+// serializer of its own.
+struct VectorSerializer {
+  template <typename T>
+  bool Save(FileWriter& out, const T& value) const {
+    if constexpr (std::is_same_v<T, std::vector<int>>) {
+      uint32_t size = value.size();
+      return out.Write(&size, sizeof(size)) &&
+             out.Write(value.data(), size * sizeof(int));
+    } else {
+      return BinarySerializer().Save(out, value);
+    }
+  }
+
+  template <typename T>
+  std::optional<T> Load(FileReader& in) const {
+    if constexpr (std::is_same_v<T, std::vector<int>>) {
+      uint32_t size;
+      if (!in.Read(&size, sizeof(size))) return std::nullopt;
+      std::vector<int> value(size);
+      if (!in.Read(value.data(), size * sizeof(int))) return std::nullopt;
+      return value;
+    } else {
+      return BinarySerializer().Load<T>(in);
+    }
+  }
+};
+
+// A table saved and loaded into an empty one holds the same items in the
+// same order, with every bucket initialized.
+template <typename Table, typename Serializer, typename MakeValue>
+void CheckSaveLoad(MakeValue make_value) {
+  typedef typename Table::Stats Stats;
+  std::FILE* file = std::tmpfile();
+  const int fd = fileno(file);
+  const int n = kElements2;
+  Table table;
+  for (int i = 0; i < n; ++i) {
+    table.Insert(i, make_value(i));
+  }
+  for (int i = 0; i < n; i += 3) {
+    table.Delete(i);
+  }
+  assert(table.SaveTo(fd, Serializer()));
+
+  lseek(fd, 0, SEEK_SET);
+  Table loaded;
+  assert(loaded.LoadFrom(fd, Serializer()));
+  assert(loaded.size_exact() == table.size_exact());
+  std::vector<int> keys;
+  table.ForEach([&](int key, const auto&) { keys.push_back(key); });
+  size_t i = 0;
+  loaded.ForEach([&](int key, const auto& value) {
+    assert(i < keys.size() && key == keys[i++] && value == make_value(key));
+  });
+  assert(i == keys.size());
+  Stats stats = loaded.GetStats();
+  assert(stats.size == keys.size() &&
+         stats.dummy_nodes == stats.bucket_size);
+  for (int key = 0; key < n; ++key) {
+    typename Table::Cursor cursor(loaded);
+    std::decay_t<decltype(make_value(key))> value;
+    assert(cursor.Find(key, value) == (key % 3 != 0));
+  }
+
+  // Loading into a table which holds items overrides them.
+  Table merged;
+  for (int key = 0; key < n; key += 2) {
+    merged.Insert(key, make_value(key + 1));
+  }
+  merged.Delete(n - 2);
+  lseek(fd, 0, SEEK_SET);
+  assert(merged.LoadFrom(fd, Serializer()));
+  for (int key = 0; key < n; ++key) {
+    std::decay_t<decltype(make_value(key))> value;
+    bool found = merged.Find(key, value);
+    if (key % 3 != 0) {
+      assert(found && value == make_value(key));
+    } else {
+      assert(found == (key % 2 == 0 && key != n - 2));
+    }
+  }
+
+  // A file which ends early is refused, with the items read so far loaded.
+  off_t size = lseek(fd, 0, SEEK_END);
+  assert(0 == ftruncate(fd, size / 2));
+  lseek(fd, 0, SEEK_SET);
+  Table truncated;
+  assert(!truncated.LoadFrom(fd, Serializer()));
+  assert(truncated.size_exact() > 0 && truncated.size_exact() < keys.size());
+  std::fclose(file);
+}
+
+// Items saved by a table of another Hash come out of order and are inserted.
+void CheckLoadOtherHash() {
+  std::FILE* file = std::tmpfile();
+  const int fd = fileno(file);
+  const int n = kElements1;
+  LockFreeHashTable<int, int> table;
+  for (int i = 0; i < n; ++i) {
+    table.Insert(i, i);
+  }
+  assert(table.SaveTo(fd));
+  lseek(fd, 0, SEEK_SET);
+  LockFreeHashTable<int, int, HighBitsHash> loaded;
+  assert(loaded.LoadFrom(fd));
+  assert(loaded.size_exact() == static_cast<size_t>(n));
+  for (int i = 0; i < n; ++i) {
+    int value;
+    assert(loaded.Find(i, value) && value == i);
+  }
+
+  assert(0 == ftruncate(fd, 0));
+  lseek(fd, 0, SEEK_SET);
+  assert(1 == write(fd, "x", 1));
+  lseek(fd, 0, SEEK_SET);
+  assert(!loaded.LoadFrom(fd));
+  std::fclose(file);
+}
+
+// Corrupt files are refused without sizing the table or a string for what
+// their header or a length claims.
+void CheckLoadCorrupt() {
+  std::FILE* file = std::tmpfile();
+  const int fd = fileno(file);
+  auto rewrite = [fd](uint64_t count, const std::string& items,
+                      uint64_t saved) {
+    const uint32_t magic = 0x5448464c, format = 1;
+    const uint8_t end = 0;
+    std::string bytes;
+    bytes.append(reinterpret_cast<const char*>(&magic), sizeof(magic));
+    bytes.append(reinterpret_cast<const char*>(&format), sizeof(format));
+    bytes.append(reinterpret_cast<const char*>(&count), sizeof(count));
+    bytes += items;
+    bytes.append(reinterpret_cast<const char*>(&end), sizeof(end));
+    bytes.append(reinterpret_cast<const char*>(&saved), sizeof(saved));
+    assert(0 == ftruncate(fd, 0));
+    lseek(fd, 0, SEEK_SET);
+    assert(static_cast<ssize_t>(bytes.size()) ==
+           write(fd, bytes.data(), bytes.size()));
+    lseek(fd, 0, SEEK_SET);
+  };
+
+  // A header which claims 2^40 items of a file which holds none.
+  rewrite(uint64_t(1) << 40, "", 0);
+  LockFreeHashTable<int, std::string> table;
+  assert(!table.LoadFrom(fd));
+  assert(LockFreeHashTableTest::BucketSize(table) <= 64);
+
+  // The same header over a file of many small items, which sizes the buckets
+  // no larger than the items do.
+  std::string items;
+  const int n = kElements1;
+  LockFreeHashTable<int, int> inserted;
+  for (int i = 0; i < n; ++i) {
+    const uint8_t tag = 1;
+    items.append(reinterpret_cast<const char*>(&tag), sizeof(tag));
+    items.append(reinterpret_cast<const char*>(&i), sizeof(i));
+    items.append(reinterpret_cast<const char*>(&i), sizeof(i));
+    inserted.Insert(i, i);
+  }
+  rewrite(uint64_t(1) << 40, items, n);
+  LockFreeHashTable<int, int> ints;
+  assert(!ints.LoadFrom(fd));
+  assert(ints.size_exact() == static_cast<size_t>(n));
+  assert(LockFreeHashTableTest::BucketSize(ints) <=
+         LockFreeHashTableTest::BucketSize(inserted));
+
+  // A trailer which disagrees with the header.
+  const uint8_t tag = 1;
+  const int key = 7;
+  const uint64_t length = 1;
+  std::string item;
+  item.append(reinterpret_cast<const char*>(&tag), sizeof(tag));
+  item.append(reinterpret_cast<const char*>(&key), sizeof(key));
+  item.append(reinterpret_cast<const char*>(&length), sizeof(length));
+  item += "x";
+  rewrite(2, item, 1);
+  assert(!table.LoadFrom(fd));
+  rewrite(1, item, 1);
+  assert(table.LoadFrom(fd));
+  std::string value;
+  assert(table.Find(key, value) && value == "x");
+
+  // A string which claims 2^62 characters.
+  const uint64_t huge = uint64_t(1) << 62;
+  item.replace(sizeof(tag) + sizeof(key), sizeof(huge),
+               reinterpret_cast<const char*>(&huge), sizeof(huge));
+  rewrite(1, item, 1);
+  LockFreeHashTable<int, std::string> strings;
+  assert(!strings.LoadFrom(fd));
+  assert(strings.size_exact() == 0);
+  std::fclose(file);
+}
+
+void TestSaveLoad() {
+  auto int_value = [](int key) { return 2 * key; };
+  auto string_value = [](int key) { return std::to_string(key); };
+  auto vector_value = [](int key) { return std::vector<int>(key % 5, key); };
+  CheckSaveLoad<LockFreeHashTable<int, int>, BinarySerializer>(int_value);
+  CheckSaveLoad<LockFreeHashTable<int, std::string, std::hash<int>,
+                                  std::equal_to<int>, DefaultAllocator,
+                                  SegmentGeometry<4, 64, std::ratio<1, 2>,
+                                                  std::ratio<1, 8>>,
+                                  EpochReclamation>,
+                BinarySerializer>(string_value);
+  CheckSaveLoad<LockFreeHashTable<int, std::vector<int>, std::hash<int>,
+                                  std::equal_to<int>, DefaultAllocator,
+                                  FlatGeometry<10>>,
+                VectorSerializer>(vector_value);
+  CheckSaveLoad<LockFreeHashTable<int, int, std::hash<int>,
+                                  std::equal_to<int>, DefaultAllocator,
+                                  DefaultGeometry, HazardPointerReclamation,
+                                  true>,
+                BinarySerializer>(int_value);
+  CheckLoadOtherHash();
+  CheckLoadCorrupt();
+}
+
+void Check() {
+  TestReverse();
+  TestTransparentLookup();
+  TestEqualityOnlyKey();
+  TestSlabAllocator();
+  TestGeometry();
+  TestShrink();
+  TestReserve();
+  TestSize();
+  TestStats();
+  TestEpochReclamation();
+  TestQuiescentReclamation();
+  TestReclamationDomain();
+  TestFlush();
+  TestInsertBatch();
+  TestFindBatch();
+  TestCursor();
+  TestForEach();
+  TestParallelForEach();
+  TestSnapshot();
+  TestSaveLoad();
+  std::cout << "All checks passed"
+            << "\n";
+}
+
+int main(int argc, char const* argv[]) {
   srand(std::time(0));
 
+  if (argc > 1) {
+    std::string name = argv[1];
+    if (name == "check") {
+      Check();
+    } else if (name == "node") {
+      BenchmarkNode();
+    } else if (name == "alloc") {
+      BenchmarkAllocator();
+    } else if (name == "reverse") {
+      BenchmarkReverse();
+    } else if (name == "bucket") {
+      BenchmarkBucket();
+    } else if (name == "reclaim") {
+      BenchmarkReclamation();
+    } else if (name == "batch") {
+      BenchmarkBatch();
+    } else if (name == "findbatch") {
+      BenchmarkFindBatch();
+    } else if (name == "cursor") {
+      BenchmarkCursor();
+    } else if (name == "foreach") {
+      BenchmarkForEach();
+    } else if (name == "parallel") {
+      BenchmarkParallelForEach();
+    } else if (name == "snapshot") {
+      BenchmarkSnapshot();
+    } else if (name == "reload") {
+      BenchmarkReload();
+    } else if (name == "domain") {
+      BenchmarkDomain();
+    } else if (name == "reserve") {
+      BenchmarkReserve();
+    } else {
+      std::cout << "Unknown benchmark " << name << "\n";
+      return 1;
+    }
+    return 0;
+  }
+
   std::cout << "Benchmark with " << kMaxThreads << " threads:"
             << "\n";
 